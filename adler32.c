@@ -59,6 +59,178 @@ local uLong adler32_combine_ OF((uLong adler1, uLong adler2, z_off64_t len2));
 #  define MOD63(a) a %= BASE
 #endif
 
+/* On x86 Linux builds, do long buffers with SSSE3 or AVX2, whichever the CPU
+   has, as found once at startup.  Without either the loops below are used. */
+#if !defined(ADLER32_SIMD) && defined(LINUX) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#  define ADLER32_SIMD
+#endif
+
+#ifdef ADLER32_SIMD
+#include <immintrin.h>
+
+#define SIMD_BLOCK 32   /* bytes summed per step, NMAX / 32 steps between MODs */
+
+/*
+   Each step adds a block of 32 bytes: sum2 gains 32 times adler as it was
+   before the block plus the bytes weighted 32, 31, ... 1, and adler gains the
+   plain byte sum.  The adler values before each block are summed up in ps and
+   multiplied by 32 at the end of a run of steps.  pmaddubsw does the byte
+   weighting, with a largest pair sum of 255 * (32 + 31), and psadbw the plain
+   sums.
+ */
+local uLong adler32_ssse3 OF((unsigned long adler, unsigned long sum2,
+                              const Bytef *buf, z_size_t len))
+    __attribute__((target("ssse3")));
+
+local uLong adler32_ssse3(adler, sum2, buf, len)
+    unsigned long adler;
+    unsigned long sum2;
+    const Bytef *buf;
+    z_size_t len;
+{
+    const __m128i tap1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                       24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i tap2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9,
+                                       8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i v_s1, v_s2, v_ps, b1, b2;
+    z_size_t blocks;
+    unsigned n;
+
+    blocks = len / SIMD_BLOCK;
+    len -= blocks * SIMD_BLOCK;
+    while (blocks) {
+        n = NMAX / SIMD_BLOCK;
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+        v_ps = _mm_cvtsi32_si128((int)(adler * n));
+        v_s2 = _mm_cvtsi32_si128((int)sum2);
+        v_s1 = zero;
+        do {
+            b1 = _mm_loadu_si128((const __m128i *)buf);
+            b2 = _mm_loadu_si128((const __m128i *)(buf + 16));
+            v_ps = _mm_add_epi32(v_ps, v_s1);
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b1, zero));
+            v_s2 = _mm_add_epi32(v_s2,
+                       _mm_madd_epi16(_mm_maddubs_epi16(b1, tap1), ones));
+            v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(b2, zero));
+            v_s2 = _mm_add_epi32(v_s2,
+                       _mm_madd_epi16(_mm_maddubs_epi16(b2, tap2), ones));
+            buf += SIMD_BLOCK;
+        } while (--n);
+        v_s2 = _mm_add_epi32(v_s2, _mm_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0x4e));
+        v_s1 = _mm_add_epi32(v_s1, _mm_shuffle_epi32(v_s1, 0xb1));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0x4e));
+        v_s2 = _mm_add_epi32(v_s2, _mm_shuffle_epi32(v_s2, 0xb1));
+        adler += (unsigned)_mm_cvtsi128_si32(v_s1);
+        sum2 = (unsigned)_mm_cvtsi128_si32(v_s2);
+        MOD(adler);
+        MOD(sum2);
+    }
+
+    /* less than a block left */
+    if (len) {
+        while (len--) {
+            adler += *buf++;
+            sum2 += adler;
+        }
+        MOD(adler);
+        MOD(sum2);
+    }
+    return adler | (sum2 << 16);
+}
+
+/* The same with the 32 bytes of a block in one register */
+local uLong adler32_avx2 OF((unsigned long adler, unsigned long sum2,
+                             const Bytef *buf, z_size_t len))
+    __attribute__((target("avx2")));
+
+local uLong adler32_avx2(adler, sum2, buf, len)
+    unsigned long adler;
+    unsigned long sum2;
+    const Bytef *buf;
+    z_size_t len;
+{
+    const __m256i tap = _mm256_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25,
+                                         24, 23, 22, 21, 20, 19, 18, 17,
+                                         16, 15, 14, 13, 12, 11, 10, 9,
+                                         8, 7, 6, 5, 4, 3, 2, 1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i v_s1, v_s2, v_ps, b;
+    __m128i h_s1, h_s2;
+    z_size_t blocks;
+    unsigned n;
+
+    blocks = len / SIMD_BLOCK;
+    len -= blocks * SIMD_BLOCK;
+    while (blocks) {
+        n = NMAX / SIMD_BLOCK;
+        if (n > blocks)
+            n = (unsigned)blocks;
+        blocks -= n;
+        v_ps = _mm256_setr_epi32((int)(adler * n), 0, 0, 0, 0, 0, 0, 0);
+        v_s2 = _mm256_setr_epi32((int)sum2, 0, 0, 0, 0, 0, 0, 0);
+        v_s1 = zero;
+        do {
+            b = _mm256_loadu_si256((const __m256i *)buf);
+            v_ps = _mm256_add_epi32(v_ps, v_s1);
+            v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(b, zero));
+            v_s2 = _mm256_add_epi32(v_s2,
+                       _mm256_madd_epi16(_mm256_maddubs_epi16(b, tap), ones));
+            buf += SIMD_BLOCK;
+        } while (--n);
+        v_s2 = _mm256_add_epi32(v_s2, _mm256_slli_epi32(v_ps, 5));
+
+        /* add up the lanes */
+        h_s1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1),
+                             _mm256_extracti128_si256(v_s1, 1));
+        h_s2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2),
+                             _mm256_extracti128_si256(v_s2, 1));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, 0x4e));
+        h_s1 = _mm_add_epi32(h_s1, _mm_shuffle_epi32(h_s1, 0xb1));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, 0x4e));
+        h_s2 = _mm_add_epi32(h_s2, _mm_shuffle_epi32(h_s2, 0xb1));
+        adler += (unsigned)_mm_cvtsi128_si32(h_s1);
+        sum2 = (unsigned)_mm_cvtsi128_si32(h_s2);
+        MOD(adler);
+        MOD(sum2);
+    }
+
+    /* less than a block left */
+    if (len) {
+        while (len--) {
+            adler += *buf++;
+            sum2 += adler;
+        }
+        MOD(adler);
+        MOD(sum2);
+    }
+    return adler | (sum2 << 16);
+}
+
+/* the best of the above for this CPU, or Z_NULL */
+local uLong (*adler32_simd) OF((unsigned long adler, unsigned long sum2,
+                                const Bytef *buf, z_size_t len));
+
+local void adler32_simd_init OF((void)) __attribute__((constructor));
+
+local void adler32_simd_init()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        adler32_simd = adler32_avx2;
+    else if (__builtin_cpu_supports("ssse3"))
+        adler32_simd = adler32_ssse3;
+}
+#endif
+
 /* ========================================================================= */
 uLong ZEXPORT adler32_z(adler, buf, len)
     uLong adler;
@@ -99,6 +271,12 @@ uLong ZEXPORT adler32_z(adler, buf, len)
         return adler | (sum2 << 16);
     }
 
+#ifdef ADLER32_SIMD
+    /* worth it once there are a couple of blocks */
+    if (adler32_simd != Z_NULL && len >= 2 * SIMD_BLOCK)
+        return adler32_simd(adler, sum2, buf, len);
+#endif
+
     /* do length NMAX blocks -- requires just one modulo operation */
     while (len >= NMAX) {
         len -= NMAX;
@@ -0,0 +1,3 @@
+#!/bin/sh
+# Build and run the benchmarks in tests/
+gcc -O2 -std=gnu89 -DLINUX -o adlerbench tests/adlerbench.c zutil.c && ./adlerbench
@@ -55,17 +55,26 @@ int stream_size;
 #else
     strm->zfree = zcfree;
 #endif
-    state = (struct inflate_state FAR *)ZALLOC(strm, 1,
-                                               sizeof(struct inflate_state));
-    if (state == Z_NULL) return Z_MEM_ERROR;
-    Tracev((stderr, "inflate: allocated\n"));
-    strm->state = (struct internal_state FAR *)state;
+// ==== DEBUG - I use a static buffer (already set) to avoid this memory allocation
+    state =(struct inflate_state FAR *)strm->state;
+    if (state == Z_NULL) return Z_STREAM_ERROR;
+// ==== DEBUG
+//    state = (struct inflate_state FAR *)ZALLOC(strm, 1,
+//                                               sizeof(struct inflate_state));
+//    if (state == Z_NULL) return Z_MEM_ERROR;
+//    Tracev((stderr, "inflate: allocated\n"));
+//    strm->state = (struct internal_state FAR *)state;
     state->dmax = 32768U;
     state->wbits = (uInt)windowBits;
     state->wsize = 1U << windowBits;
     state->window = window;
     state->wnext = 0;
     state->whave = 0;
+    state->obase = Z_NULL;
+    state->slack = 0;
+#ifdef INFLATE_FASTFIXED
+    state->fixed = 0;
+#endif
     return Z_OK;
 }
 
@@ -120,6 +129,12 @@ struct inflate_state FAR *state;
     state->lenbits = 9;
     state->distcode = distfix;
     state->distbits = 5;
+#ifdef INFLATE_MULTISYM
+    state->pairs = lenfix;      /* no two fixed literal codes fit in 9 bits */
+#endif
+#ifdef INFLATE_FASTFIXED
+    state->fixed = 1;
+#endif
 }
 
 /* Macros for inflateBack(): */
@@ -475,6 +490,13 @@ void FAR *out_desc;
                 state->mode = BAD;
                 break;
             }
+#ifdef INFLATE_MULTISYM
+            inflate_pairs(state->lencode, state->lenbits, state->pairtab);
+            state->pairs = state->pairtab;
+#endif
+#ifdef INFLATE_FASTFIXED
+            state->fixed = 0;
+#endif
             Tracev((stderr, "inflate:       codes ok\n"));
             state->mode = LEN;
 
@@ -484,6 +506,11 @@ void FAR *out_desc;
                 RESTORE();
                 if (state->whave < state->wsize)
                     state->whave = state->wsize - left;
+#ifdef INFLATE_FASTFIXED
+                if (state->fixed)
+                    inflate_fast_fixed(strm, state->wsize);
+                else
+#endif
                 inflate_fast(strm, state->wsize);
                 LOAD();
                 break;
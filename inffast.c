@@ -12,6 +12,99 @@
 #  pragma message("Assembler code may have bugs -- use at your own risk")
 #else
 
+/* On 64-bit little-endian hosts keep a 64-bit bit accumulator and refill it
+   with one unaligned eight byte load instead of a byte at a time. */
+#if !defined(INFLATE_FAST64) && defined(LINUX) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__aarch64__)) && \
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#  define INFLATE_FAST64
+#endif
+
+#ifdef INFLATE_FAST64
+typedef unsigned long long hold_t;
+/* Top hold up to 56..63 bits.  The load also puts the low bits of the next,
+   not yet accounted for byte above bit "bits" -- the next load puts the very
+   same bits there, which is why hold is only ever or'ed into below. */
+#  define REFILL64() \
+    do { \
+        hold_t chunk; \
+        zmemcpy(&chunk, in, 8); \
+        hold |= chunk << bits; \
+        in += (63 - bits) >> 3; \
+        bits |= 56; \
+    } while (0)
+#else
+typedef unsigned long hold_t;
+#endif
+
+/* Where the application allows writing a little past the end of the output
+   (see inflateOutputSlack()), do match copies a word at a time. */
+#if !defined(INFLATE_CHUNKCOPY) && defined(LINUX) && defined(__GNUC__)
+#  define INFLATE_CHUNKCOPY
+#endif
+
+#ifdef INFLATE_CHUNKCOPY
+#  define CHUNKSLACK 16     /* most chunkcopy() writes past out + len */
+
+/*
+   Copy a match of len bytes at distance dist that lies entirely in the output,
+   that is from == out - dist, eight or sixteen bytes at a time.  For distances
+   under eight the first dist bytes are replicated into an eight byte pattern
+   that is then stored every period bytes, period being the largest multiple
+   of dist that fits, so dist == 1 becomes a run fill.  Returns out + len, and
+   may clobber up to CHUNKSLACK - 1 bytes after that.
+ */
+local unsigned char FAR *chunkcopy(out, from, dist, len)
+unsigned char FAR *out;
+z_const unsigned char FAR *from;
+unsigned dist;
+unsigned len;
+{
+    unsigned char FAR *end = out + len;
+    unsigned char pat[8];
+    unsigned i;
+
+    if (dist >= 16) {
+        do {
+            zmemcpy(out, from, 16);
+            out += 16;
+            from += 16;
+        } while (out < end);
+    }
+    else if (dist >= 8) {
+        do {
+            zmemcpy(out, from, 8);
+            out += 8;
+            from += 8;
+        } while (out < end);
+    }
+    else {
+        for (i = 0; i < 8; i++)
+            pat[i] = i < dist ? from[i] : pat[i - dist];
+        dist = 8 - 8 % dist;
+        do {
+            zmemcpy(out, pat, 8);
+            out += dist;
+        } while (out < end);
+    }
+    return end;
+}
+#endif
+
+#ifdef INFLATE_MULTISYM
+/* root lookups go through state->pairs, where op 128 is a literal pair */
+#  define LITERAL(op) (((op) & 127) == 0)
+#  define PUTLIT(here) \
+    do { \
+        *out++ = (unsigned char)((here).val); \
+        if ((here).op) \
+            *out++ = (unsigned char)((here).val >> 8); \
+    } while (0)
+#else
+#  define LITERAL(op) ((op) == 0)
+#  define PUTLIT(here) (*out++ = (unsigned char)((here).val))
+#endif
+
 /*
    Decode literal, length, and distance codes and write out the resulting
    literal and match bytes until either not enough input or output is
@@ -42,18 +135,54 @@
       Therefore if strm->avail_in >= 6, then there is enough input to avoid
       checking for available input while decoding.
 
+    - With INFLATE_FAST64 the accumulator is topped up to at least 56 bits
+      whenever it drops below 48 and eight bytes of input remain, so a whole
+      length/distance pair, or a run of literals, decodes without refills.
+
+    - With INFLATE_MULTISYM the first lookup of each code is made in the
+      literal pair table, whose op 128 entries put out two literals at once.
+      Nothing is stored past the literals, as inflateBack() keeps history
+      there.  Second level lookups use lcode, which holds no pairs.
+
     - The maximum bytes that a single length/distance pair can output is 258
       bytes, which is the maximum length that can be coded.  inflate_fast()
       requires strm->avail_out >= 258 for each loop to avoid checking for
       output space.
+
+    - With INFLATE_CHUNKCOPY and at least CHUNKSLACK bytes of slack after the
+      output, matches copied from the output itself go through chunkcopy(),
+      which can overrun the end of the match by up to CHUNKSLACK - 1 bytes.
+      Copies from the sliding window stay byte by byte, as reading past the
+      end of the window is not allowed.
+
+    - With INFLATE_FASTFIXED this is inflate_fast_body(), which is inlined
+      into inflate_fast() and into inflate_fast_fixed() with fixed a constant.
+      The fixed codes have a 9-bit literal/length and 5-bit distance root and
+      no second level tables, so that copy gets constant masks and does
+      without the table link checks.
  */
+#ifdef INFLATE_FASTFIXED
+local void inflate_fast_body OF((z_streamp strm, unsigned start, int fixed))
+    __attribute__((always_inline));
+
+local __inline__ void inflate_fast_body(strm, start, fixed)
+z_streamp strm;
+unsigned start;         /* inflate()'s starting value for strm->avail_out */
+int fixed;              /* true if the codes are the fixed ones */
+#else
+#  define fixed 0
+
 void ZLIB_INTERNAL inflate_fast(strm, start)
 z_streamp strm;
 unsigned start;         /* inflate()'s starting value for strm->avail_out */
+#endif
 {
     struct inflate_state FAR *state;
     z_const unsigned char FAR *in;      /* local strm->next_in */
     z_const unsigned char FAR *last;    /* have enough input while in < last */
+#ifdef INFLATE_FAST64
+    z_const unsigned char FAR *last64;  /* can load eight bytes while in < last64 */
+#endif
     unsigned char FAR *out;     /* local strm->next_out */
     unsigned char FAR *beg;     /* inflate()'s initial strm->next_out */
     unsigned char FAR *end;     /* while out < end, enough space available */
@@ -64,9 +193,14 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     unsigned whave;             /* valid bytes in the window */
     unsigned wnext;             /* window write index */
     unsigned char FAR *window;  /* allocated sliding window, if wsize != 0 */
-    unsigned long hold;         /* local strm->hold */
+    hold_t hold;                /* local strm->hold */
     unsigned bits;              /* local strm->bits */
     code const FAR *lcode;      /* local strm->lencode */
+#ifdef INFLATE_MULTISYM
+    code const FAR *pcode;      /* local strm->pairs */
+#else
+#  define pcode lcode
+#endif
     code const FAR *dcode;      /* local strm->distcode */
     unsigned lmask;             /* mask for first level of length codes */
     unsigned dmask;             /* mask for first level of distance codes */
@@ -76,13 +210,22 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     unsigned len;               /* match length, unused bytes */
     unsigned dist;              /* match distance */
     unsigned char FAR *from;    /* where to copy match from */
+#ifdef INFLATE_CHUNKCOPY
+    int chunk;                  /* true if matches can overrun their end */
+#endif
 
     /* copy state to local variables */
     state = (struct inflate_state FAR *)strm->state;
     in = strm->next_in;
     last = in + (strm->avail_in - 5);
+#ifdef INFLATE_FAST64
+    last64 = strm->avail_in >= 8 ? in + (strm->avail_in - 7) : in;
+#endif
     out = strm->next_out;
-    beg = out - (start - strm->avail_out);
+    if (state->obase != Z_NULL)     /* the whole output is the window */
+        beg = state->obase;
+    else
+        beg = out - (start - strm->avail_out);
     end = out + (strm->avail_out - 257);
 #ifdef INFLATE_STRICT
     dmax = state->dmax;
@@ -94,37 +237,63 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     hold = state->hold;
     bits = state->bits;
     lcode = state->lencode;
+#ifdef INFLATE_MULTISYM
+    pcode = fixed ? lcode : state->pairs;
+#endif
     dcode = state->distcode;
-    lmask = (1U << state->lenbits) - 1;
-    dmask = (1U << state->distbits) - 1;
+    lmask = fixed ? 511U : (1U << state->lenbits) - 1;
+    dmask = fixed ? 31U : (1U << state->distbits) - 1;
+#ifdef INFLATE_CHUNKCOPY
+    chunk = state->slack >= CHUNKSLACK;
+#endif
 
     /* decode literals and length/distances until end-of-block or not enough
        input data or output space */
     do {
+#ifdef INFLATE_FAST64
+        if (bits < 48 && in < last64)
+            REFILL64();
+        else
+#endif
         if (bits < 15) {
-            hold += (unsigned long)(*in++) << bits;
+            hold |= (hold_t)(*in++) << bits;
             bits += 8;
-            hold += (unsigned long)(*in++) << bits;
+            hold |= (hold_t)(*in++) << bits;
             bits += 8;
         }
-        here = lcode[hold & lmask];
+        here = pcode[hold & lmask];
       dolen:
         op = (unsigned)(here.bits);
         hold >>= op;
         bits -= op;
         op = (unsigned)(here.op);
-        if (op == 0) {                          /* literal */
+        if (LITERAL(op)) {                      /* literal(s) */
             Tracevv((stderr, here.val >= 0x20 && here.val < 0x7f ?
                     "inflate:         literal '%c'\n" :
                     "inflate:         literal 0x%02x\n", here.val));
-            *out++ = (unsigned char)(here.val);
+            PUTLIT(here);
+#ifdef INFLATE_FAST64
+            /* usually enough bits left for a couple more literals */
+            here = pcode[hold & lmask];
+            if (LITERAL(here.op) && here.bits <= bits) {
+                hold >>= here.bits;
+                bits -= here.bits;
+                PUTLIT(here);
+                here = pcode[hold & lmask];
+                if (LITERAL(here.op) && here.bits <= bits) {
+                    hold >>= here.bits;
+                    bits -= here.bits;
+                    PUTLIT(here);
+                }
+            }
+#endif
         }
         else if (op & 16) {                     /* length base */
             len = (unsigned)(here.val);
             op &= 15;                           /* number of extra bits */
             if (op) {
                 if (bits < op) {
-                    hold += (unsigned long)(*in++) << bits;
+                    hold |= (hold_t)(*in++) << bits;
                     bits += 8;
                 }
                 len += (unsigned)hold & ((1U << op) - 1);
@@ -133,9 +302,9 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
             }
             Tracevv((stderr, "inflate:         length %u\n", len));
             if (bits < 15) {
-                hold += (unsigned long)(*in++) << bits;
+                hold |= (hold_t)(*in++) << bits;
                 bits += 8;
-                hold += (unsigned long)(*in++) << bits;
+                hold |= (hold_t)(*in++) << bits;
                 bits += 8;
             }
             here = dcode[hold & dmask];
@@ -148,10 +317,10 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 dist = (unsigned)(here.val);
                 op &= 15;                       /* number of extra bits */
                 if (bits < op) {
-                    hold += (unsigned long)(*in++) << bits;
+                    hold |= (hold_t)(*in++) << bits;
                     bits += 8;
                     if (bits < op) {
-                        hold += (unsigned long)(*in++) << bits;
+                        hold |= (hold_t)(*in++) << bits;
                         bits += 8;
                     }
                 }
@@ -236,6 +405,12 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                             from = out - dist;  /* rest from output */
                         }
                     }
+#ifdef INFLATE_CHUNKCOPY
+                    if (chunk && from == out - dist) {  /* rest from output */
+                        out = chunkcopy(out, from, dist, len);
+                        continue;
+                    }
+#endif
 //                    if (len > 50 && len < dist) {
 //                        memmove(out, from, len);
 //                        out += len;
@@ -257,6 +432,12 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 }
                 else {
                     from = out - dist;          /* copy direct from output */
+#ifdef INFLATE_CHUNKCOPY
+                    if (chunk) {
+                        out = chunkcopy(out, from, dist, len);
+                        continue;
+                    }
+#endif
                     // Larry Bank added -
                     // For relatively large runs, it's faster to let memmove
                     // use whatever code is efficient on the target platform
@@ -283,7 +464,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
 //                    }
                 }
             }
-            else if ((op & 64) == 0) {          /* 2nd level distance code */
+            else if (!fixed && (op & 64) == 0) {    /* 2nd level distance code */
                 here = dcode[here.val + (hold & ((1U << op) - 1))];
                 goto dodist;
             }
@@ -293,7 +474,7 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
                 break;
             }
         }
-        else if ((op & 64) == 0) {              /* 2nd level length code */
+        else if (!fixed && (op & 64) == 0) {    /* 2nd level length code */
             here = lcode[here.val + (hold & ((1U << op) - 1))];
             goto dolen;
         }
@@ -326,6 +507,24 @@ unsigned start;         /* inflate()'s starting value for strm->avail_out */
     return;
 }
 
+#ifdef INFLATE_FASTFIXED
+void ZLIB_INTERNAL inflate_fast(strm, start)
+z_streamp strm;
+unsigned start;
+{
+    inflate_fast_body(strm, start, 0);
+}
+
+void ZLIB_INTERNAL inflate_fast_fixed(strm, start)
+z_streamp strm;
+unsigned start;
+{
+    inflate_fast_body(strm, start, 1);
+}
+#else
+#  undef fixed
+#endif
+
 /*
    inflate_fast() speedups that turned out slower (on a PowerPC G3 750CXe):
    - Using bit fields for code structure
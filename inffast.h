@@ -9,3 +9,8 @@
  */
 
 void ZLIB_INTERNAL inflate_fast OF((z_streamp strm, unsigned start));
+
+/* inflate_fast() for the fixed codes, see INFLATE_FASTFIXED in inflate.h */
+#ifdef INFLATE_FASTFIXED
+void ZLIB_INTERNAL inflate_fast_fixed OF((z_streamp strm, unsigned start));
+#endif
@@ -135,8 +135,16 @@ z_streamp strm;
     state->hold = 0;
     state->bits = 0;
     state->lencode = state->distcode = state->next = state->codes;
+#ifdef INFLATE_MULTISYM
+    state->pairs = state->lencode;
+#endif
+#ifdef INFLATE_FASTFIXED
+    state->fixed = 0;
+#endif
     state->sane = 1;
     state->back = -1;
+    state->obase = Z_NULL;
+    state->slack = 0;
     Tracev((stderr, "inflate: reset\n"));
     return Z_OK;
 }
@@ -320,6 +328,12 @@ struct inflate_state FAR *state;
     state->lenbits = 9;
     state->distcode = distfix;
     state->distbits = 5;
+#ifdef INFLATE_MULTISYM
+    state->pairs = lenfix;      /* no two fixed literal codes fit in 9 bits */
+#endif
+#ifdef INFLATE_FASTFIXED
+    state->fixed = 1;
+#endif
 }
 
 #ifdef MAKEFIXED
@@ -1044,6 +1058,13 @@ int check_crc;
                 state->mode = BAD;
                 break;
             }
+#ifdef INFLATE_MULTISYM
+            inflate_pairs(state->lencode, state->lenbits, state->pairtab);
+            state->pairs = state->pairtab;
+#endif
+#ifdef INFLATE_FASTFIXED
+            state->fixed = 0;
+#endif
             Tracev((stderr, "inflate:       codes ok\n"));
             state->mode = LEN_;
             if (flush == Z_TREES) goto inf_leave;
@@ -1052,6 +1073,11 @@ int check_crc;
         case LEN:
             if (have >= 6 && left >= 258) {
                 RESTORE();
+#ifdef INFLATE_FASTFIXED
+                if (state->fixed)
+                    inflate_fast_fixed(strm, out);
+                else
+#endif
                 inflate_fast(strm, out);
                 LOAD();
                 if (state->mode == TYPE)
@@ -1153,7 +1179,10 @@ int check_crc;
             state->mode = MATCH;
         case MATCH:
             if (left == 0) goto inf_leave;
-            copy = out - left;
+            if (state->obase != Z_NULL)     /* all output so far is history */
+                copy = (unsigned)(put - state->obase);
+            else
+                copy = out - left;
             if (state->offset > copy) {         /* copy from window */
                 copy = state->offset - copy;
                 if (copy > state->whave) {
@@ -1264,8 +1293,9 @@ int check_crc;
      */
   inf_leave:
     RESTORE();
-    if (state->wsize || (out != strm->avail_out && state->mode < BAD &&
-            (state->mode < CHECK || flush != Z_FINISH)))
+    if (state->obase == Z_NULL &&
+        (state->wsize || (out != strm->avail_out && state->mode < BAD &&
+            (state->mode < CHECK || flush != Z_FINISH))))
         if (updatewindow(strm, strm->next_out, out - strm->avail_out)) {
             state->mode = MEM;
             return Z_MEM_ERROR;
@@ -1360,6 +1390,41 @@ uInt dictLength;
     return Z_OK;
 }
 
+/*
+   Use the output itself as the sliding window: everything written from base
+   on stays put, so match distances can always be resolved from the output and
+   no copy of it has to be kept in state->window.
+ */
+int ZEXPORT inflateOutputWindow(strm, base)
+z_streamp strm;
+Bytef *base;
+{
+    struct inflate_state FAR *state;
+
+    /* check state */
+    if (inflateStateCheck(strm) || base == Z_NULL) return Z_STREAM_ERROR;
+    state = (struct inflate_state FAR *)strm->state;
+    if (state->wsize || strm->total_out) return Z_STREAM_ERROR;
+
+    state->obase = base;
+    Tracev((stderr, "inflate:   window in output\n"));
+    return Z_OK;
+}
+
+int ZEXPORT inflateOutputSlack(strm, slack)
+z_streamp strm;
+unsigned slack;
+{
+    struct inflate_state FAR *state;
+
+    /* check state */
+    if (inflateStateCheck(strm)) return Z_STREAM_ERROR;
+    state = (struct inflate_state FAR *)strm->state;
+    state->slack = slack;
+    Tracev((stderr, "inflate:   %u bytes of output slack\n", slack));
+    return Z_OK;
+}
+
 int ZEXPORT inflateGetHeader(strm, head)
 z_streamp strm;
 gz_headerp head;
@@ -1510,6 +1575,12 @@ z_streamp source;
         copy->distcode = copy->codes + (state->distcode - state->codes);
     }
     copy->next = copy->codes + (state->next - state->codes);
+#ifdef INFLATE_MULTISYM
+    if (state->pairs == state->pairtab)
+        copy->pairs = copy->pairtab;
+    else
+        copy->pairs = copy->lencode;
+#endif
     if (window != Z_NULL) {
         wsize = 1U << state->wbits;
         zmemcpy(window, state->window, wsize);
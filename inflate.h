@@ -77,6 +77,13 @@ typedef enum {
         CHECK -> LENGTH -> DONE
  */
 
+/* A copy of inflate_fast() made for the fixed codes, with their table sizes
+   as constants and the second level table lookups left out.  inflate() and
+   inflateBack() use it when state->fixed is set. */
+#if !defined(INFLATE_FASTFIXED) && defined(LINUX) && defined(__GNUC__)
+#  define INFLATE_FASTFIXED
+#endif
+
 /* State maintained between inflate() calls -- approximately 7K bytes, not
    including the allocated sliding window, which is up to 32K bytes. */
 struct inflate_state {
@@ -97,6 +104,8 @@ struct inflate_state {
     unsigned whave;             /* valid bytes in the window */
     unsigned wnext;             /* window write index */
     unsigned char FAR *window;  /* allocated sliding window, if needed */
+    unsigned char FAR *obase;   /* output used as the window, or Z_NULL */
+    unsigned slack;             /* writable bytes past the end of the output */
         /* bit accumulator */
     unsigned long hold;         /* input bit accumulator */
     unsigned bits;              /* number of bits in "in" */
@@ -119,6 +128,13 @@ struct inflate_state {
     unsigned short lens[320];   /* temporary storage for code lengths */
     unsigned short work[288];   /* work area for code table building */
     code codes[ENOUGH];         /* space for code tables */
+#ifdef INFLATE_FASTFIXED
+    int fixed;                  /* true if lencode and distcode are fixed */
+#endif
+#ifdef INFLATE_MULTISYM
+    code const FAR *pairs;      /* lencode root with literal pairs merged */
+    code pairtab[ENOUGH_PAIRS]; /* space for a built pairs table */
+#endif
     int sane;                   /* if false, allow invalid distance too far */
     int back;                   /* bits back of last unprocessed length/lit */
     unsigned was;               /* initial length of match */
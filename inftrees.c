@@ -302,3 +302,37 @@ unsigned short FAR *work;
     *bits = root;
     return 0;
 }
+
+#ifdef INFLATE_MULTISYM
+/*
+   Build the literal pair table for the literal/length table lcode with a root
+   of bits index bits.  For a literal of length len in entry i, the next code
+   is indexed by the bits of i above len.  If it is a literal no longer than
+   bits - len, the entry for it is the same for every value of the unknown high
+   index bits, so lcode[i >> len] is the one, and the two are merged into a
+   single entry of bits len plus its length.  All other entries are copied as
+   is, so the pair table can stand in for the root of lcode.
+ */
+void ZLIB_INTERNAL inflate_pairs(lcode, bits, pairs)
+code const FAR *lcode;
+unsigned bits;
+code FAR *pairs;
+{
+    unsigned i, n;
+    code here, next;
+
+    n = 1U << bits;
+    for (i = 0; i < n; i++) {
+        here = lcode[i];
+        if (here.op == 0 && here.bits < bits) {
+            next = lcode[i >> here.bits];
+            if (next.op == 0 && here.bits + next.bits <= bits) {
+                here.op = 128;
+                here.val |= next.val << 8;
+                here.bits += next.bits;
+            }
+        }
+        pairs[i] = here;
+    }
+}
+#endif
@@ -33,6 +33,8 @@ typedef struct {
     0001eeee - length or distance, eeee is the number of extra bits
     01100000 - end of block
     01000000 - invalid code
+    10000000 - two literals, val holds the first in its low byte and the
+               second in its high byte (only made by inflate_pairs())
  */
 
 /* Maximum size of the dynamic table.  The maximum number of code structures is
@@ -60,3 +62,18 @@ typedef enum {
 int ZLIB_INTERNAL inflate_table OF((codetype type, unsigned short FAR *lens,
                              unsigned codes, code FAR * FAR *table,
                              unsigned FAR *bits, unsigned short FAR *work));
+
+/* Literal pair tables: a copy of the root of a literal/length table in which
+   each literal entry whose code leaves room in the root bits for a whole
+   second literal code holds both literals, so inflate_fast() can put out two
+   bytes per lookup.  On by default for the Linux build. */
+#if !defined(INFLATE_MULTISYM) && defined(LINUX)
+#  define INFLATE_MULTISYM
+#endif
+
+#ifdef INFLATE_MULTISYM
+#define ENOUGH_PAIRS 512        /* 1 << the literal/length root bits (9) */
+
+void ZLIB_INTERNAL inflate_pairs OF((code const FAR *lcode, unsigned bits,
+                                     code FAR *pairs));
+#endif
@@ -9,6 +9,8 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #else
 #include <io.h>
 #include <fcntl.h>
@@ -75,8 +77,33 @@ static uint8_t winbmphdr[54 + 1024] =
 static int bm_bitoff;
 static int32_t BmpStride;
 static uint8_t *BMPLine;	 
+static uint8_t br, bg, bb; /* background color of the truecolor and gray + alpha lines */
+static uint8_t *(*pngConvert)(PNGDRAW *d, uint8_t *out); /* the line converter for the image */
 static int32_t pngHeight;
 static int32_t desiredBackground = -1;
+static int decodeOptions = 0;
+static int stripRows = 0; /* 0: size the strip by PNG_STRIP_BUDGET, -1: whole image */
+#ifdef LINUX
+static long fileBufSize = 65536L; /* 0: the built in PNG_FILE_BUF_SIZE buffer */
+static int drawRows = 16; /* lines the decoder hands over (and we write) at a time */
+#else
+static long fileBufSize = 0;
+static int drawRows = 1;
+#endif
+#define DRAW_ROWS_MAX 64
+#ifdef PNG_HAVE_THREADS
+/* -t: the decoder inflates on a thread of its own, and the BMP lines get
+ * written out on another one, from a ring of WRITE_LINES lines */
+#define WRITE_LINES 32
+static int useThreads = 0;
+static uint8_t *writeRing; /* WRITE_LINES lines of BmpStride bytes */
+static off_t writePos[WRITE_LINES];
+static int writeFd;
+static int writeIn, writeOut, writeEnd; /* lines queued, lines written */
+static pthread_t writeThread;
+static pthread_mutex_t writeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writeCond = PTHREAD_COND_INITIALIZER;
+#endif
 
 static uint8_t expandbits8(int idx, int bits)
 {
@@ -115,6 +142,117 @@ static void wwrite(int fd, uint8_t*buf, unsigned len)
 	} while (written < len);
 }
 
+#ifdef PNG_HAVE_THREADS
+/* The writer thread: write the queued lines out until told to end */
+static void *writeLines(void *arg)
+{
+	uint8_t *line;
+	unsigned written;
+	ssize_t r;
+	off_t pos;
+	int fd;
+
+	(void)arg;
+	pthread_mutex_lock(&writeMutex);
+	for (;;) {
+		while (writeOut == writeIn && !writeEnd)
+			pthread_cond_wait(&writeCond, &writeMutex);
+		if (writeOut == writeIn)
+			break;
+		line = writeRing + (size_t)(writeOut % WRITE_LINES) * BmpStride;
+		pos = writePos[writeOut % WRITE_LINES];
+		fd = writeFd;
+		pthread_mutex_unlock(&writeMutex);
+		for (written = 0; written < (unsigned)BmpStride; written += r) {
+			r = pwrite(fd, line + written, BmpStride - written, pos + written);
+			if (r == -1)
+				xout("write", NULL, 2);
+			if (r == 0) {
+				fprintf(stderr,"short write - disk full?");
+				exit(2);
+			}
+		}
+		pthread_mutex_lock(&writeMutex);
+		writeOut++;
+		pthread_cond_broadcast(&writeCond);
+	}
+	pthread_mutex_unlock(&writeMutex);
+	return NULL;
+}
+
+/* Hand a line (len bytes, padded to BmpStride) to the writer thread */
+static void writeQueue(int fd, off_t pos, uint8_t *buf, int32_t len)
+{
+	uint8_t *line;
+
+	pthread_mutex_lock(&writeMutex);
+	while (writeIn - writeOut == WRITE_LINES)
+		pthread_cond_wait(&writeCond, &writeMutex);
+	pthread_mutex_unlock(&writeMutex);
+	/* the writer doesn't look at this one until writeIn says so */
+	line = writeRing + (size_t)(writeIn % WRITE_LINES) * BmpStride;
+	memcpy(line, buf, len);
+	memset(line + len, 0, BmpStride - len);
+	pthread_mutex_lock(&writeMutex);
+	writeFd = fd;
+	writePos[writeIn % WRITE_LINES] = pos;
+	writeIn++;
+	pthread_cond_broadcast(&writeCond);
+	pthread_mutex_unlock(&writeMutex);
+}
+#endif
+
+/* Wait for the lines still queued to be written out */
+static void writeFinish(void)
+{
+#ifdef PNG_HAVE_THREADS
+	if (!writeRing)
+		return;
+	pthread_mutex_lock(&writeMutex);
+	writeEnd = 1;
+	pthread_cond_broadcast(&writeCond);
+	pthread_mutex_unlock(&writeMutex);
+	pthread_join(writeThread, NULL);
+#endif
+}
+
+#ifdef LINUX
+/* wwrite() for a batch of lines */
+static void wwritev(int fd, struct iovec *iov, int n)
+{
+	ssize_t r;
+
+	while (n > 0) {
+		r = writev(fd, iov, n);
+		if (r == -1)
+			xout("write",NULL, 2);
+		if (r == 0) {
+			fprintf(stderr,"short write - disk full?");
+			exit(2);
+		}
+		for (; n > 0 && (size_t)r >= iov->iov_len; iov++, n--)
+			r -= iov->iov_len;
+		if (n > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + r;
+			iov->iov_len -= r;
+		}
+	}
+}
+#endif
+
+/* Fill in the rest of the BMP header (Bpp and the palette are set) and write it out */
+static void bmpHeader(int fd, int32_t width, int palettecnt)
+{
+	*(short*)(winbmphdr+46) = palettecnt;
+	bm_bitoff = 54 + (4*palettecnt);
+	*(int32_t*)(winbmphdr+2) = bm_bitoff + pngHeight * BmpStride;
+	*(short*)(winbmphdr+10) = bm_bitoff;
+	*(int32_t*)(winbmphdr+18) = width;
+	*(int32_t*)(winbmphdr+22) = pngHeight;
+	
+	wwrite(fd, winbmphdr, bm_bitoff);
+}
+
 static void pngDraw_init(PNGDRAW *d)
 {
 	uint8_t *bm_palette = winbmphdr + 54;
@@ -213,20 +351,9 @@ static void pngDraw_init(PNGDRAW *d)
 				for (i = 0; i < palettecnt; i++) {
 					uint8_t a = d->pPalette[768 + i];
 					if (a==255) continue;
-					if (a==0) {
-						bm_palette[i*4 + 0] = bb;
-						bm_palette[i*4 + 1] = bg;
-						bm_palette[i*4 + 2] = br;
-					} else {
-						uint16_t b_r=br, b_g=bg, b_b=bb;
-						uint16_t r,g,b;
-						b = bm_palette[i*4 + 0];
-						g = bm_palette[i*4 + 1];
-						r = bm_palette[i*4 + 2];
-						bm_palette[i*4+2] = ((r * a) + (b_r * (255-a))) >> 8;
-                        bm_palette[i*4+1] = ((g * a) + (b_g * (255-a))) >> 8;
-                        bm_palette[i*4+0] = ((b * a) + (b_b * (255-a))) >> 8;
-					}
+					bm_palette[i*4 + 0] = PNG_BLEND255(bm_palette[i*4 + 0], bb, a);
+					bm_palette[i*4 + 1] = PNG_BLEND255(bm_palette[i*4 + 1], bg, a);
+					bm_palette[i*4 + 2] = PNG_BLEND255(bm_palette[i*4 + 2], br, a);
 				}
 			}
 			break;
@@ -242,282 +369,302 @@ static void pngDraw_init(PNGDRAW *d)
 			exit(9);
 			break;
 	}
-	*(short*)(winbmphdr+46) = palettecnt;
-	bm_bitoff = 54 + (4*palettecnt);
-	*(int32_t*)(winbmphdr+2) = bm_bitoff + pngHeight * BmpStride;
-	*(short*)(winbmphdr+10) = bm_bitoff;
-	*(int32_t*)(winbmphdr+18) = d->iWidth;
-	*(int32_t*)(winbmphdr+22) = pngHeight;
-	
-	wwrite(d->User, winbmphdr, bm_bitoff);
+	bmpHeader(d->User, d->iWidth, palettecnt);
 }
 
-static void pngDraw(PNGDRAW *d)
+/* The line converters, one for each pixel format, pngConvert_init() picks
+ * the one for the image. They return the line to write: out, or the
+ * pixels themselves when they are BMP pixels already. */
+
+/* 1 and 2 bit pixels go to BMP's 4 bit ones a byte at a time, through
+ * the 4 (2) bytes each value of the byte makes, worked out once */
+static uint8_t bits1Lut[256][4], bits2Lut[256][2];
+
+static void bitsLut_init(void)
+{
+	int v;
+
+	if (bits1Lut[255][0]) /* (it is 0x11 once done) */
+		return;
+	for (v = 0; v < 256; v++) {
+		bits1Lut[v][0] = (v & 0x80) >> 3 | (v & 0x40) >> 6;
+		bits1Lut[v][1] = (v & 0x20) >> 1 | (v & 0x10) >> 4;
+		bits1Lut[v][2] = (v & 0x08) << 1 | (v & 0x04) >> 2;
+		bits1Lut[v][3] = (v & 0x02) << 3 | (v & 0x01);
+		bits2Lut[v][0] = (v & 0xC0) >> 2 | (v & 0x30) >> 4;
+		bits2Lut[v][1] = (v & 0x0C) << 2 | (v & 0x03);
+	}
+}
+
+static uint8_t *convBits1(PNGDRAW *d, uint8_t *out)
 {
+	uint8_t *line = out;
 	int32_t i;
-	off_t linesdown;
-	off_t dyp;
-	uint8_t *line = BMPLine;
-	int32_t linepitch = BmpStride;
-	uint8_t br,bb,bg;
-	
-	if (d->y==0) /* Initialize */
-		pngDraw_init(d);
-	
-	/* BMP is a horrible format. The Arachne BMP reader is even more horrible. */
-	linesdown = (pngHeight - d->y) -1;
-	dyp = bm_bitoff + (linesdown * BmpStride);
-	lseek(d->User, dyp, SEEK_SET);
 
-	/* Determine the background color (for these 3 formats) */
-	switch  (d->iPixelType) {
-		case PNG_PIXEL_TRUECOLOR:
-		case PNG_PIXEL_TRUECOLOR_ALPHA:
-			if (desiredBackground>=0) {
-				br =  desiredBackground       & 0xFF;
-				bg = (desiredBackground >> 8) & 0xFF;
-				bb = (desiredBackground >> 16)& 0xFF;
-			} else {
-				br =  d->iBackground       & 0xFF;
-				bg = (d->iBackground >> 8) & 0xFF;
-				bb = (d->iBackground >> 16)& 0xFF;
-			}
-			break;
+	for (i = 0; i < d->iPitch; i++, line += 4)
+		memcpy(line, bits1Lut[d->pPixels[i]], 4);
+	return out;
+}
 
-		case PNG_PIXEL_GRAY_ALPHA:
-			if (desiredBackground>=0) {
-				br =  desiredBackground       & 0xFF;
-				bg = (desiredBackground >> 8) & 0xFF;
-				bb = (desiredBackground >> 16)& 0xFF;
-			} else {
-				br = d->iBackground;
-				bg = d->iBackground;
-				bb = d->iBackground;
-			}
-			break;
+static uint8_t *convBits2(PNGDRAW *d, uint8_t *out)
+{
+	uint8_t *line = out;
+	int32_t i;
+
+	for (i = 0; i < d->iPitch; i++, line += 2)
+		memcpy(line, bits2Lut[d->pPixels[i]], 2);
+	return out;
+}
+
+/* 4 and 8 bit grayscale and indexed: BMP has those as they are */
+static uint8_t *convCopy(PNGDRAW *d, uint8_t *out)
+{
+	(void)out;
+	return d->pPixels;
+}
+
+/* 16b grayscale, operated like 8bit grayscale except we need to splice the bytes out of there */
+#define CONV_GRAY16(name, TRNS) \
+static uint8_t *name(PNGDRAW *d, uint8_t *out) \
+{ \
+	uint8_t *line = out; \
+	int32_t i; \
+	for (i = 0; i < d->iPitch; i += 2) { \
+		if (TRNS && memcmp(d->iTrans, d->pPixels+i, 2)==0) /* iTRNS comparison, full 16bpp */ \
+			line[i/2] = desiredBackground; \
+		else \
+			line[i/2] = d->pPixels[i]; \
+	} \
+	return line; \
+}
+CONV_GRAY16(convGray16, 0)
+CONV_GRAY16(convGray16Trns, 1)
+
+/* Truecolor, S bytes a sample (of which the first, high one is used).
+ * BMP is a horrible format. */
+#define CONV_RGB(name, S, TRNS) \
+static uint8_t *name(PNGDRAW *d, uint8_t *out) \
+{ \
+	uint8_t *line = out, *p = d->pPixels; \
+	int32_t i; \
+	for (i = 0; i < d->iWidth; i++, p += 3*S, line += 3) { \
+		if (TRNS && memcmp(d->iTrans, p, 3*S)==0) { \
+			line[2] = br; \
+			line[1] = bg; \
+			line[0] = bb; \
+		} else { \
+			line[2] = p[0]; \
+			line[1] = p[S]; \
+			line[0] = p[2*S]; \
+		} \
+	} \
+	return out; \
+}
+CONV_RGB(convRgb8, 1, 0)
+CONV_RGB(convRgb8Trns, 1, 1)
+CONV_RGB(convRgb16, 2, 0)
+CONV_RGB(convRgb16Trns, 2, 1)
+
+/* And the alpha here is not implemented because i dont parse bKGD yet :P, and also because lazy,
+ * and also because i'd like to hook up the background color from arachne, but also that 
+ * it'd really make more sense to integrate the whole thing into arachne, so why bother with
+ * fancy features... */
+
+/* Gray + alpha (C = 1) or truecolor + alpha (C = 3), S bytes a sample,
+ * over the background; the same sums for every pixel, opaque or not */
+#define CONV_ALPHA(name, C, S) \
+static uint8_t *name(PNGDRAW *d, uint8_t *out) \
+{ \
+	uint8_t *line = out, *p = d->pPixels; \
+	int32_t i; \
+	for (i = 0; i < d->iWidth; i++, p += (C+1)*S, line += 3) { \
+		unsigned a = p[C*S]; \
+		line[0] = PNG_BLEND255(p[(C-1)*S], bb, a); \
+		line[1] = PNG_BLEND255(p[(C-1)/2*S], bg, a); \
+		line[2] = PNG_BLEND255(p[0], br, a); \
+	} \
+	return out; \
+}
+CONV_ALPHA(convGrayAlpha8, 1, 1)
+CONV_ALPHA(convGrayAlpha16, 1, 2)
+CONV_ALPHA(convRgba8, 3, 1)
+CONV_ALPHA(convRgba16, 3, 2)
+
+#ifdef PNG_DEFILTER_SIMD
+/* Truecolor without tRNS and truecolor + alpha, 8 or 16 bit, 16 pixels
+ * at a time by the decoder's SSSE3 or AVX2 loop */
+static uint8_t *convSimd(PNGDRAW *d, uint8_t *out)
+{
+	(*pngToBGRSimd)(out, d->pPixels, d->iPitch / d->iWidth, d->iWidth,
+		br | (uint32_t)bg << 8 | (uint32_t)bb << 16);
+	return out;
+}
+#endif
+
+/* Pick the line converter for the image, and the background color for
+ * the truecolor and gray + alpha ones */
+static void pngConvert_init(PNGDRAW *d)
+{
+	if (desiredBackground>=0) {
+		br =  desiredBackground       & 0xFF;
+		bg = (desiredBackground >> 8) & 0xFF;
+		bb = (desiredBackground >> 16)& 0xFF;
+	} else if (d->iPixelType == PNG_PIXEL_GRAY_ALPHA) {
+		br = bg = bb = d->iBackground;
+	} else {
+		br =  d->iBackground       & 0xFF;
+		bg = (d->iBackground >> 8) & 0xFF;
+		bb = (d->iBackground >> 16)& 0xFF;
 	}
-	
+
 	switch (d->iPixelType) {
-		case PNG_PIXEL_GRAYSCALE:				
+		case PNG_PIXEL_GRAYSCALE:
 		case PNG_PIXEL_INDEXED:
-			switch(d->iBpp) {
-				case 1:
-					for (i = 0; i < d->iPitch; i++) {
-						uint8_t v = d->pPixels[i];
-						line[i*4 + 0] = (v & 0x80) >> 3 | (v & 0x40) >> 6;
-						line[i*4 + 1] = (v & 0x20) >> 1 | (v & 0x10) >> 4;
-						line[i*4 + 2] = (v & 0x08) << 1 | (v & 0x04) >> 2;
-						line[i*4 + 3] = (v & 0x02) << 3 | (v & 0x01);
-					}
-					break;
-				case 2:
-					for (i = 0; i < d->iPitch; i++) {
-						uint8_t v = d->pPixels[i];
-						line[i*2 + 0] = (v & 0xC0) >> 2 | (v & 0x30) >> 4;
-						line[i*2 + 1] = (v & 0x0C) << 2 | (v & 0x03);
-					}
-					break;
-				case 4:
-				case 8:
-					line = d->pPixels;
-					linepitch = d->iPitch;
-					break;
-				case 16: /* 16b grayscale, operated like 8bit grayscale except we need to splice the bytes out of there */
-					if (d->iTransLen==2) { // iTRNS comparison, full 16bpp
-						for (i = 0; i < d->iPitch; i += 2) {
-							if (memcmp(d->iTrans, d->pPixels+i, 2)==0) {
-								line[i/2] = desiredBackground;
-							} else {
-								line[i/2] = d->pPixels[i];
-							}
-						}
-					} else {
-						for (i = 0;i < d->iPitch; i += 2) {
-							line[i/2] = d->pPixels[i];
-						}
-					}
-					break;
-					
+			switch (d->iBpp) {
+				case 1: pngConvert = convBits1; bitsLut_init(); break;
+				case 2: pngConvert = convBits2; bitsLut_init(); break;
+				case 16: pngConvert = (d->iTransLen==2) ? convGray16Trns : convGray16; break;
+				default: pngConvert = convCopy; break;
 			}
 			break;
-
 		case PNG_PIXEL_TRUECOLOR:
-			/* BMP is a horrible format. */
-			if (d->iBpp > 8) {
-				if (d->iTransLen==6) {
-					for (i = 0; i < d->iPitch; i+= 6) {
-						if (memcmp(d->iTrans, d->pPixels+i, 6)==0) {
-							line[(i/2)+2] = br;
-							line[(i/2)+1] = bg;
-							line[(i/2)+0] = bb;
-						} else {
-							line[(i/2)+2] = d->pPixels[i+0];
-							line[(i/2)+1] = d->pPixels[i+2];
-							line[(i/2)+0] = d->pPixels[i+4];
-						}
-					}
-				} else {
-					for (i = 0; i < d->iPitch; i+= 6) {
-						line[(i/2)+2] = d->pPixels[i+0];
-						line[(i/2)+1] = d->pPixels[i+2];
-						line[(i/2)+0] = d->pPixels[i+4];
-					}
-				}
-			} else {
-				if (d->iTransLen==3) {
-					for (i = 0; i < d->iPitch; i+= 3) {
-						if (memcmp(d->iTrans, d->pPixels+i, 3)==0) {
-							line[i+2] = br;
-							line[i+1] = bg;
-							line[i+0] = bb;
-						} else {
-							line[i+2] = d->pPixels[i+0];
-							line[i+1] = d->pPixels[i+1];
-							line[i+0] = d->pPixels[i+2];
-						}
-					}
-				} else {
-					for (i = 0; i < d->iPitch; i+= 3) {
-						line[i+2] = d->pPixels[i+0];
-						line[i+1] = d->pPixels[i+1];
-						line[i+0] = d->pPixels[i+2];
-					}
-				}
-			}
+			if (d->iBpp > 8)
+				pngConvert = (d->iTransLen==6) ? convRgb16Trns : convRgb16;
+			else
+				pngConvert = (d->iTransLen==3) ? convRgb8Trns : convRgb8;
 			break;
-			
-		/* And the alpha here is not implemented because i dont parse bKGD yet :P, and also because lazy,
-		 * and also because i'd like to hook up the background color from arachne, but also that 
-		 * it'd really make more sense to integrate the whole thing into arachne, so why bother with
-		 * fancy features... */
-			
 		case PNG_PIXEL_GRAY_ALPHA:
-			if (d->iBpp > 8) {
-				for (i = 0; i < d->iPitch; i += 4) {
-					uint8_t v = d->pPixels[i];
-					uint8_t a = d->pPixels[i+2];
-					if (a == 255) {
-						line[(i/4)*3 + 0] = v;
-						line[(i/4)*3 + 1] = v;
-						line[(i/4)*3 + 2] = v;
-					} else if (a == 0) {
-						line[(i/4)*3 + 0] = bb;
-						line[(i/4)*3 + 1] = bg;
-						line[(i/4)*3 + 2] = br;						
-					} else {
-						uint16_t vb=v, b_r=br,b_g=bg, b_b=bb;
-						line[(i/4)*3 + 0] =	((vb * a) + (b_b * (255-a))) >> 8;
-						line[(i/4)*3 + 1] =	((vb * a) + (b_g * (255-a))) >> 8;
-						line[(i/4)*3 + 2] =	((vb * a) + (b_r * (255-a))) >> 8;
-					}
-				}
-			} else {
-				for (i = 0; i < d->iPitch; i += 2) {
-					uint8_t v = d->pPixels[i];
-					uint8_t a = d->pPixels[i+1];
-					if (a == 255) {
-						line[(i/2)*3 + 0] = v;
-						line[(i/2)*3 + 1] = v;
-						line[(i/2)*3 + 2] = v;
-					} else if (a == 0) {
-						line[(i/2)*3 + 0] = bb;
-						line[(i/2)*3 + 1] = bg;
-						line[(i/2)*3 + 2] = br;						
-					} else {
-						uint16_t vb=v, b_r=br,b_g=bg, b_b=bb;
-						line[(i/2)*3 + 0] =	((vb * a) + (b_b * (255-a))) >> 8;
-						line[(i/2)*3 + 1] =	((vb * a) + (b_g * (255-a))) >> 8;
-						line[(i/2)*3 + 2] =	((vb * a) + (b_r * (255-a))) >> 8;
-					}
-				}
-			}
+			pngConvert = (d->iBpp > 8) ? convGrayAlpha16 : convGrayAlpha8;
 			break;
-				
 		case PNG_PIXEL_TRUECOLOR_ALPHA:
-			if (d->iBpp > 8) {
-				for (i = 0; i < d->iPitch; i += 8) {
-					uint8_t a = d->pPixels[i + 6];
-					if (a==255) {
-						line[(i/8)*3 + 2] = d->pPixels[i + 0];
-						line[(i/8)*3 + 1] = d->pPixels[i + 2];
-						line[(i/8)*3 + 0] = d->pPixels[i + 4];
-					} else if (a==0) {
-						line[(i/8)*3 + 0] = bb;
-						line[(i/8)*3 + 1] = bg;
-						line[(i/8)*3 + 2] = br;						
-					} else {
-						uint16_t r, g, b, b_r=br,b_g=bg, b_b=bb;
-						r = d->pPixels[i + 0];
-						g = d->pPixels[i + 2];
-						b = d->pPixels[i + 4];
-						line[(i/8)*3 + 0] = ((b * a) + (b_b * (255-a))) >> 8;
-						line[(i/8)*3 + 1] = ((g * a) + (b_g * (255-a))) >> 8;
-						line[(i/8)*3 + 2] = ((r * a) + (b_r * (255-a))) >> 8;
-					}
-				}
-			} else {
-				for (i = 0; i < d->iPitch; i += 4) {
-					uint8_t a = d->pPixels[i + 3];
-					if (a==255) {
-						line[(i/4)*3 + 2] = d->pPixels[i + 0];
-						line[(i/4)*3 + 1] = d->pPixels[i + 1];
-						line[(i/4)*3 + 0] = d->pPixels[i + 2];
-					} else if (a==0) {
-						line[(i/4)*3 + 0] = bb;
-						line[(i/4)*3 + 1] = bg;
-						line[(i/4)*3 + 2] = br;						
-					} else {
-						uint16_t r, g, b, b_r=br,b_g=bg, b_b=bb;
-						r = d->pPixels[i + 0];
-						g = d->pPixels[i + 1];
-						b = d->pPixels[i + 2];
-						line[(i/4)*3 + 0] = ((b * a) + (b_b * (255-a))) >> 8;
-						line[(i/4)*3 + 1] = ((g * a) + (b_g * (255-a))) >> 8;
-						line[(i/4)*3 + 2] = ((r * a) + (b_r * (255-a))) >> 8;
-					}						
-				}
-			}
+			pngConvert = (d->iBpp > 8) ? convRgba16 : convRgba8;
 			break;
 	}
+#ifdef PNG_DEFILTER_SIMD
+	if (pngToBGRSimd && (pngConvert == convRgb8 || pngConvert == convRgb16 ||
+			pngConvert == convRgba8 || pngConvert == convRgba16))
+		pngConvert = convSimd;
+#endif
+}
+
+/* Write the d->iRows lines (more than one when the decoder batches them)
+ * into their place, in one go */
+static void pngDraw(PNGDRAW *d)
+{
+	PNGDRAW row;
+	off_t dyp;
+	uint8_t *line, *out;
+	uint8_t z[4] = { 0,0,0,0 };
+	int32_t linepitch;
+	int i;
+#ifdef LINUX
+	struct iovec iov[2 * DRAW_ROWS_MAX];
+	int n = 0;
+#endif
+	
+	if (d->y==0 && d->iPass <= 1) { /* Initialize (once, progressive images come again after each pass) */
+		pngDraw_init(d);
+		pngConvert_init(d);
+	}
 	
-	wwrite(d->User, line, linepitch);
-	if (linepitch < BmpStride) {
-		uint8_t z[4] = { 0,0,0,0 };
-		wwrite(d->User, z, BmpStride - linepitch);
+	/* BMP is a horrible format. The Arachne BMP reader is even more horrible.
+	 * The lines go bottom up, so the last one of the batch comes first. */
+	dyp = bm_bitoff + (off_t)(pngHeight - d->y - d->iRows) * BmpStride;
+#ifndef LINUX
+	lseek(d->User, dyp, SEEK_SET);
+#endif
+	row = *d;
+	for (i = d->iRows - 1; i >= 0; i--) {
+		row.y = d->y + i;
+		row.pPixels = d->pPixels + (size_t)i * d->iStride;
+		out = BMPLine + (size_t)i * BmpStride;
+		if (d->pBGR) {
+			line = d->pBGR + (size_t)i * d->iWidth * 3;
+			linepitch = d->iWidth * 3;
+		} else {
+			line = (*pngConvert)(&row, out);
+			linepitch = (line == out) ? BmpStride : d->iPitch;
+		}
+#ifdef PNG_HAVE_THREADS
+		if (writeRing) {
+			writeQueue(d->User, dyp + (off_t)(d->iRows - 1 - i) * BmpStride, line, linepitch);
+			continue;
+		}
+#endif
+#ifdef LINUX
+		iov[n].iov_base = line;
+		iov[n++].iov_len = linepitch;
+		if (linepitch < BmpStride) {
+			iov[n].iov_base = z;
+			iov[n++].iov_len = BmpStride - linepitch;
+		}
+#else
+		wwrite(d->User, line, linepitch);
+		if (linepitch < BmpStride)
+			wwrite(d->User, z, BmpStride - linepitch);
+#endif
+	}
+#ifdef LINUX
+	if (n) {
+		lseek(d->User, dyp, SEEK_SET);
+		wwritev(d->User, iov, n);
 	}
+#endif
 }
 
-int main(int argc, char **argv)
+/* Write an APNG frame (the whole canvas, over the background) into its place
+ * in the output: the frames go top to bottom in one 24-bit BMP */
+static void pngFrame(PNGFRAME *f)
 {
-	PNGIMAGE *pPNG;
-	const int argoff = 1;
-	int ifd, ofd;
-	int r;
-	if (argc < 3) {
-		fprintf(stderr,"usage: png2bmp <in.png> <out.bmp>\n");
-		return 1;
+	int32_t x, y;
+	off_t linesdown;
+	uint8_t br,bb,bg;
+	uint8_t *c = f->pCanvas;
+	int32_t bgc = (desiredBackground >= 0) ? desiredBackground : f->iBackground;
+
+	if (f->iFrame == 0) {
+		pngHeight = f->iHeight * f->iFrameCount;
+		winbmphdr[28] = 24;
+		bmpHeader(f->User, f->iWidth, 0);
 	}
-	
-	/* N.B. We can exit() without freeing everything, it's fine. */
-	pPNG = calloc(1, sizeof(PNGIMAGE));
-	if (!pPNG) xout("malloc", "PNGIMAGE", 3);
-	
-	ifd = open(argv[argoff], O_RDONLY|O_BINARY);
-	if (ifd < 0) xout("open", argv[argoff], 1);
-	
-    pPNG->pfnRead = pngRead;
-    pPNG->pfnSeek = pngSeek;
-    pPNG->pfnDraw = pngDraw;
-    pPNG->PNGFile.fHandle = ifd;
-    pPNG->PNGFile.iSize = lseek(pPNG->PNGFile.fHandle, 0, SEEK_END);
-	lseek(pPNG->PNGFile.fHandle, 0, SEEK_SET);
-	
-	r = PNG_init(pPNG);
-	if (r) {
-		fprintf(stderr, "PNG Error (Header): %d\n", pPNG->iError);
-		exit(4);
+	br =  bgc       & 0xFF;
+	bg = (bgc >> 8) & 0xFF;
+	bb = (bgc >> 16)& 0xFF;
+	for (y = 0; y < f->iHeight; y++) {
+		for (x = 0; x < f->iWidth; x++, c += 4) {
+			unsigned a = c[3];
+			BMPLine[x*3 + 0] = PNG_BLEND255(c[2], bb, a);
+			BMPLine[x*3 + 1] = PNG_BLEND255(c[1], bg, a);
+			BMPLine[x*3 + 2] = PNG_BLEND255(c[0], br, a);
+		}
+		memset(BMPLine + x*3, 0, BmpStride - x*3);
+		linesdown = pngHeight - (f->iFrame * f->iHeight + y) - 1;
+		lseek(f->User, bm_bitoff + linesdown * BmpStride, SEEK_SET);
+		wwrite(f->User, BMPLine, BmpStride);
 	}
-	
+}
+
+/* Allocate the buffers for the image, once PNG_init() has parsed its header
+ * (or as the pfnHeader of a feed) */
+static void pngSetup(PNGIMAGE *pPNG, long User)
+{
+	int32_t size;
+
+	(void)User;
+	if (stripRows < 0)
+		stripRows = PNG_getStripRows(pPNG, 0x7FFFFFFFL);
+	else if (stripRows == 0)
+		stripRows = PNG_getStripRows(pPNG, PNG_STRIP_BUDGET);
+	else /* clamps to the image height (and to 64k on DOS) */
+		stripRows = PNG_getStripRows(pPNG, (int32_t)stripRows * (pPNG->iPitch+1));
+
+	if (stripRows > 1) {
+		pPNG->iStripRows = stripRows;
+		pPNG->pStrip = malloc((size_t)stripRows * (pPNG->iPitch+1) + PNG_STRIP_PAD);
+		if (!pPNG->pStrip)
+			xout("malloc", "Strip", 3);
+	}
+
     pPNG->uLine1 = malloc(pPNG->iPitch+1);
 	if (!pPNG->uLine1)
 		xout("malloc", "Line1", 3);
@@ -526,6 +673,36 @@ int main(int argc, char **argv)
 	if (!pPNG->uLine2)
 		xout("malloc", "Line2", 3);
 
+	if (pPNG->iInterlaced) {
+		size = PNG_getDeinterlaceSize(pPNG, decodeOptions);
+		if (size <= 0 || (int32_t)(size_t)size != size) { /* 64k on DOS */
+			fprintf(stderr,"Interlaced image too big (%ld bytes to deinterlace)\n", (long)size);
+			exit(3);
+		}
+		pPNG->pDeinterlace = malloc((size_t)size);
+		if (!pPNG->pDeinterlace)
+			xout("malloc", "Deinterlace", 3);
+	}
+
+	if (decodeOptions & PNG_ANIMATE) {
+		size = PNG_getCanvasSize(pPNG);
+		if (size <= 0 || (int32_t)(size_t)size != size) { /* 64k on DOS */
+			fprintf(stderr,"Animation too big (%ld bytes of canvas)\n", (long)size);
+			exit(3);
+		}
+		pPNG->pCanvas = malloc((size_t)size);
+		if (!pPNG->pCanvas)
+			xout("malloc", "Canvas", 3);
+		pPNG->pfnFrame = pngFrame;
+	}
+
+	if (fileBufSize > PNG_FILE_BUF_SIZE && !pPNG->PNGFile.pData) {
+		pPNG->iFileBufSize = (int32_t)fileBufSize;
+		pPNG->pFileBuf = malloc((size_t)fileBufSize);
+		if (!pPNG->pFileBuf)
+			xout("malloc", "FileBuf", 3);
+	}
+
 	/*printf("PNG Info: %ldx%ld %d bpp color type %d\n",
 		(long)pPNG->iWidth, (long)pPNG->iHeight, pPNG->ucBpp, pPNG->ucPixelType); */
 	pngHeight = pPNG->iHeight;
@@ -551,6 +728,8 @@ int main(int argc, char **argv)
 			BmpStride = pPNG->iWidth*3;
 			break;
 	}
+	if (decodeOptions & PNG_ANIMATE) /* the frames come as RGBA, written as 24 bits */
+		BmpStride = pPNG->iWidth*3;
 	BmpStride = (BmpStride + 3) & ~3;
 	
 	if (BmpStride >= 65535) {
@@ -558,13 +737,293 @@ int main(int argc, char **argv)
 		exit(3);
 	}
 	
-	BMPLine = malloc(BmpStride);
+	size = (int32_t)drawRows * (BmpStride > pPNG->iPitch + 1 ? BmpStride : pPNG->iPitch + 1);
+	if ((int32_t)(size_t)size != size) { /* 64k on DOS */
+		fprintf(stderr,"Too many lines at a time (%ld bytes of them)\n", (long)size);
+		exit(3);
+	}
+	BMPLine = calloc(drawRows, BmpStride); /* a line for each one drawn at a time */
 	if (!BMPLine) xout("malloc", "BMPLine", 3);
+	if (drawRows > 1) {
+		pPNG->iDrawRows = drawRows;
+		pPNG->pDrawRows = malloc((size_t)drawRows * (pPNG->iPitch + 1));
+		if (!pPNG->pDrawRows) xout("malloc", "DrawRows", 3);
+	}
+#ifdef PNG_HAVE_THREADS
+	if (useThreads) {
+		int32_t rows = (1L << 20) / (pPNG->iPitch + 1); /* about 1MB of rows */
+		if (rows > 256) rows = 256;
+		if (rows < 4) rows = 4;
+		pPNG->iRingRows = (int)rows;
+		pPNG->pRing = malloc((size_t)rows * (pPNG->iPitch + 1));
+		if (!pPNG->pRing) xout("malloc", "Ring", 3);
+		writeRing = malloc((size_t)WRITE_LINES * BmpStride);
+		if (!writeRing) xout("malloc", "WriteRing", 3);
+		if (pthread_create(&writeThread, NULL, writeLines, NULL) != 0) {
+			free(writeRing); /* write them out here then */
+			writeRing = NULL;
+		}
+	}
+#endif
+	/* 8-bit truecolor lines come converted already, straight into BMPLine,
+	 * or a block of their own when they come several at a time */
+	if (drawRows == 1) {
+		pPNG->pBGRLine = BMPLine;
+	} else if (pPNG->ucBpp == 8 && (pPNG->ucPixelType == PNG_PIXEL_TRUECOLOR ||
+		pPNG->ucPixelType == PNG_PIXEL_TRUECOLOR_ALPHA)) {
+		pPNG->pBGRLine = malloc((size_t)drawRows * pPNG->iWidth * 3);
+		if (!pPNG->pBGRLine) xout("malloc", "BGRLines", 3);
+	}
+	pPNG->iBGRBackground = desiredBackground;
+}
+
+/* Print what PNG_probe() found out about the file */
+static void pngInfo(PNGIMAGE *pPNG, const char *name)
+{
+	char t[5];
+	int i;
+
+	printf("%s: %ldx%ld, %d bits, type %d%s\n", name, (long)pPNG->iWidth, (long)pPNG->iHeight,
+		pPNG->ucBpp, pPNG->ucPixelType, pPNG->iInterlaced ? ", interlaced" : "");
+	printf(" palette %d, transparency %s, background %ld\n", pPNG->iPaletteCnt,
+		(pPNG->iHasAlpha || pPNG->iTransLen) ? "yes" : "no", (long)(int32_t)pPNG->iBackground);
+	printf(" %d IDAT, %ld bytes\n", pPNG->iIdatCount, (long)pPNG->iIdatSize);
+	if (pPNG->iFrameCount)
+		printf(" APNG, %ld frames, %ld plays\n", (long)pPNG->iFrameCount, (long)pPNG->iLoopCount);
+	t[4] = 0;
+	for (i = 0; i < pPNG->iChunkCount && i < PNG_MAX_CHUNKS; i++) {
+		t[0] = (char)(pPNG->chunks[i].iType >> 24);
+		t[1] = (char)(pPNG->chunks[i].iType >> 16);
+		t[2] = (char)(pPNG->chunks[i].iType >> 8);
+		t[3] = (char)pPNG->chunks[i].iType;
+		printf(" %s at %ld, %ld bytes\n", t, (long)pPNG->chunks[i].iOffset, (long)pPNG->chunks[i].iLen);
+	}
+	if (pPNG->iChunkCount > PNG_MAX_CHUNKS)
+		printf(" (%d more chunks)\n", pPNG->iChunkCount - PNG_MAX_CHUNKS);
+}
+
+/* Read all of the (seekable) input into memory, for PNG_openRAM() */
+static uint8_t *pngLoad(PNGFILE *pFile)
+{
+	uint8_t *data;
+	size_t len = (size_t)pFile->iSize, done = 0;
+	int r;
+
+	if (pFile->iSize <= 0 || (off_t)len != pFile->iSize) {
+		fprintf(stderr,"Can't load the input into memory\n");
+		exit(3);
+	}
+	data = malloc(len);
+	if (!data) xout("malloc", "FileData", 3);
+	while (done < len) {
+		r = read(pFile->fHandle, data + done, len - done);
+		if (r < 0) xout("read", NULL, 1);
+		if (r == 0) break;
+		done += r;
+	}
+	pFile->iSize = done;
+	return data;
+}
+
+/* Decode by reading the input in pieces and feeding them to the decoder,
+ * the buffers get allocated when the header has come in */
+static int pngFeed(PNGIMAGE *pPNG, const char *outname, int feedSize)
+{
+	uint8_t *feedBuf;
+	int ofd, n, r;
+
+	feedBuf = malloc(feedSize);
+	if (!feedBuf) xout("malloc", "FeedBuf", 3);
+	ofd = open(outname, O_RDWR|O_BINARY|O_CREAT, 0644);
+	if (ofd < 0) xout("create", outname, 2);
+
+	pPNG->pfnHeader = pngSetup;
+	PNG_beginFeed(pPNG, ofd, decodeOptions);
+	do {
+		n = read(pPNG->PNGFile.fHandle, feedBuf, feedSize);
+		if (n < 0) xout("read", NULL, 1);
+		r = PNG_decodeFeed(pPNG, feedBuf, n);
+	} while (r == PNG_NEED_MORE && n > 0);
+	writeFinish();
+	if (r) { /* PNG_NEED_MORE: the file ended early */
+		fprintf(stderr, "PNG Error (Decode): %d\n", r);
+		exit(4);
+	}
+	close(ofd);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	PNGIMAGE *pPNG;
+	int argoff = 1;
+	int ifd, ofd;
+	int r;
+	int streamIn = 0; /* read the input front to back, never seeking it */
+	int feedSize = 0; /* hand the input to PNG_decodeFeed() in pieces this big */
+	int loadFile = 0; /* read the input into memory and decode it from there */
+	int probeOnly = 0; /* print the PNG_probe() info instead of converting */
+	uint8_t *fileData = NULL; /* the input in memory (loaded or mapped), for PNG_openRAM() */
+#ifdef LINUX
+	int useMap = 1; /* mmap() the input file rather than read() it */
+#endif
+
+	while ((argoff < argc) && (argv[argoff][0] == '-') && argv[argoff][1]) {
+		switch (argv[argoff][1]) {
+			case 's':
+				if (argoff + 1 >= argc) goto usage;
+				stripRows = atoi(argv[++argoff]);
+				break;
+			case 'b':
+				if (argoff + 1 >= argc) goto usage;
+				fileBufSize = atol(argv[++argoff]);
+				break;
+#ifdef LINUX
+			case 'r':
+				useMap = 0;
+				break;
+#endif
+			case 'S':
+				streamIn = 1;
+				break;
+			case 'F':
+				if (argoff + 1 >= argc) goto usage;
+				feedSize = atoi(argv[++argoff]);
+				if (feedSize <= 0) goto usage;
+				break;
+			case 'm':
+				loadFile = 1;
+				break;
+			case 'i':
+				probeOnly = 1;
+				break;
+			case 'n':
+				if (argoff + 1 >= argc) goto usage;
+				drawRows = atoi(argv[++argoff]);
+				if (drawRows < 1) drawRows = 1;
+				if (drawRows > DRAW_ROWS_MAX) drawRows = DRAW_ROWS_MAX;
+				break;
+			case 'w': /* whole image in one strip */
+				stripRows = -1;
+				break;
+			case 'c':
+				decodeOptions |= PNG_CHECK_CRC;
+				break;
+			case 'C':
+				decodeOptions |= PNG_CHECK_CHUNK_CRC;
+				break;
+			case 'p':
+				decodeOptions |= PNG_PROGRESSIVE;
+				break;
+			case 'a':
+				decodeOptions |= PNG_ANIMATE;
+				break;
+#ifdef PNG_HAVE_INFBACK
+			case 'B':
+				decodeOptions |= PNG_USE_INFBACK;
+				break;
+#endif
+#ifdef PNG_HAVE_THREADS
+			case 't':
+				decodeOptions |= PNG_THREADS;
+				useThreads = 1;
+				break;
+#endif
+			default:
+				goto usage;
+		}
+		argoff++;
+	}
+	if (argc - argoff < 2 - probeOnly) {
+usage:
+		fprintf(stderr,"usage: png2bmp [options] <in.png|-> <out.bmp>\n");
+		fprintf(stderr,"       png2bmp -i <in.png>\n");
+		fprintf(stderr," -i       print the image info and chunk list, no conversion\n");
+		fprintf(stderr," -        as the input: read the PNG from stdin (a pipe will do)\n");
+		fprintf(stderr," -s rows  lines inflated per strip (1 = line by line)\n");
+		fprintf(stderr," -w       inflate the whole image into memory at once\n");
+		fprintf(stderr," -n rows  lines converted and written at a time (1-%d, default %d)\n", DRAW_ROWS_MAX, drawRows);
+		fprintf(stderr," -b bytes file read buffer size (0 = built in %d)\n", PNG_FILE_BUF_SIZE);
+#ifdef LINUX
+		fprintf(stderr," -r       read() the file instead of mapping it\n");
+#endif
+		fprintf(stderr," -m       read the file into memory and decode it from there\n");
+		fprintf(stderr," -S       read the input as a stream, without seeking\n");
+		fprintf(stderr," -F bytes feed the input to the decoder in pieces this big\n");
+		fprintf(stderr," -c       verify the Adler-32 checksum of the image data\n");
+		fprintf(stderr," -C       verify the CRC-32 of the chunks decoded\n");
+		fprintf(stderr," -p       interlaced images: write the image after every pass\n");
+		fprintf(stderr," -a       APNG: write all the frames, one below the other\n");
+#ifdef PNG_HAVE_INFBACK
+		fprintf(stderr," -B       decode with inflateBack() callbacks\n");
+#endif
+#ifdef PNG_HAVE_THREADS
+		fprintf(stderr," -t       inflate, convert and write on threads of their own\n");
+#endif
+		return 1;
+	}
+	
+	/* N.B. We can exit() without freeing everything, it's fine. */
+	pPNG = calloc(1, sizeof(PNGIMAGE));
+	if (!pPNG) xout("malloc", "PNGIMAGE", 3);
+	
+	if (strcmp(argv[argoff], "-") == 0) {
+		ifd = 0; /* stdin */
+#ifndef LINUX
+		setmode(ifd, O_BINARY);
+#endif
+	} else {
+		ifd = open(argv[argoff], O_RDONLY|O_BINARY);
+		if (ifd < 0) xout("open", argv[argoff], 1);
+	}
+	
+    pPNG->pfnRead = pngRead;
+    pPNG->pfnSeek = pngSeek;
+    pPNG->pfnDraw = pngDraw;
+    pPNG->PNGFile.fHandle = ifd;
+	if (feedSize)
+		return pngFeed(pPNG, argv[argoff+1], feedSize);
+    pPNG->PNGFile.iSize = streamIn ? -1 : lseek(pPNG->PNGFile.fHandle, 0, SEEK_END);
+	if (pPNG->PNGFile.iSize < 0) { /* a pipe: no seeking, size unknown */
+		pPNG->pfnSeek = NULL;
+		pPNG->PNGFile.iSize = 0;
+	} else {
+		lseek(pPNG->PNGFile.fHandle, 0, SEEK_SET);
+	}
+#ifdef LINUX
+	if (useMap && !loadFile && pPNG->pfnSeek && pPNG->PNGFile.iSize > 0) {
+		void *map = mmap(NULL, (size_t)pPNG->PNGFile.iSize, PROT_READ, MAP_PRIVATE, ifd, 0);
+		if (map != MAP_FAILED) /* otherwise read() it after all */
+			fileData = map;
+	}
+#endif
+	if (loadFile)
+		fileData = pngLoad(&pPNG->PNGFile);
+	
+	if (fileData)
+		r = PNG_openRAM(pPNG, fileData, (int32_t)pPNG->PNGFile.iSize);
+	else
+		r = PNG_init(pPNG);
+	if (r) {
+		fprintf(stderr, "PNG Error (Header): %d\n", pPNG->iError);
+		exit(4);
+	}
+	if (probeOnly) {
+		r = PNG_probe(pPNG);
+		if (r) {
+			fprintf(stderr, "PNG Error (Probe): %d\n", pPNG->iError);
+			exit(4);
+		}
+		pngInfo(pPNG, argv[argoff]);
+		return 0;
+	}
+	pngSetup(pPNG, 0);
 	
 	ofd = open(argv[argoff+1], O_RDWR|O_BINARY|O_CREAT, 0644);
 	if (ofd < 0) xout("create", argv[argoff+1], 2);
 	
-	r = PNG_decode(pPNG, ofd, 0);
+	r = PNG_decode(pPNG, ofd, decodeOptions);
+	writeFinish();
 	if (r) {
 		fprintf(stderr, "PNG Error (Decode): %d\n", pPNG->iError);
 		exit(4);
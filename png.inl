@@ -31,25 +31,58 @@ uint8_t *PNG_getPalette(PNGIMAGE *pPNG)
     return pPNG->ucPalette;
 } /* PNG_getPalette() */
 
+#define PNG_INFO_SIZE 32 // bytes PNG_init() reads, all but the last of the IHDR CRC
+
+static void PNGSetFilters(PNGIMAGE *pPage);
+
+//
+// Read up to iLen bytes from file position iPos on, keeping PNGFile.iPos
+// up to date. Without a pfnSeek the file is a stream: it only gets seeked
+// forward, by reading past the data, and short reads are retried.
+// returns the bytes read, -1 on an I/O error (or going backwards in a stream)
+//
+static int32_t PNGReadAt(PNGIMAGE *pPage, off_t iPos, uint8_t *pBuf, int32_t iLen)
+{
+	PNGFILE *pFile = &pPage->PNGFile;
+	int32_t iRead, n;
+
+	if (pFile->iPos != iPos) {
+		if (pPage->pfnSeek) {
+			(*pPage->pfnSeek)(pFile, iPos);
+			pFile->iPos = iPos;
+		} else if (iPos < pFile->iPos) {
+			return -1;
+		} else while (pFile->iPos < iPos) { // skip ahead, pBuf takes the data
+			n = iLen;
+			if (n > iPos - pFile->iPos) n = (int32_t)(iPos - pFile->iPos);
+			iRead = (*pPage->pfnRead)(pFile, pBuf, n);
+			if (iRead <= 0)
+				return iRead;
+			pFile->iPos += iRead;
+		}
+	}
+	iRead = 0;
+	do {
+		n = (*pPage->pfnRead)(pFile, pBuf + iRead, iLen - iRead);
+		if (n < 0)
+			return -1;
+		iRead += n;
+		pFile->iPos += n;
+	} while (pPage->pfnSeek == NULL && n > 0 && iRead < iLen);
+	return iRead;
+} /* PNGReadAt() */
+
 //
 // Verify it's a PNG file and then parse the IHDR chunk
 // to get basic image size/type/etc
+// (s holds the first PNG_INFO_SIZE bytes of the file)
 //
-static int PNGParseInfo(PNGIMAGE *pPage)
+static int PNGParseHeader(PNGIMAGE *pPage, uint8_t *s)
 {
-    uint8_t s[32];
-    int iBytesRead;
     const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
 	int32_t iL;
 	
     pPage->iHasAlpha = pPage->iInterlaced = 0;
-    // Read a few bytes to just parse the size/pixel info
-    iBytesRead = (*pPage->pfnRead)(&pPage->PNGFile, s, 32);
-    if (iBytesRead < 32) { // a PNG file this tiny? probably bad
-        pPage->iError = PNG_INVALID_FILE;
-        return pPage->iError;
-    }
-
 	if (memcmp(s, signature, 8) != 0) { // check that it's a PNG file
 		pPage->iError = PNG_INVALID_FILE;
 		return pPage->iError;
@@ -63,6 +96,7 @@ static int PNGParseInfo(PNGIMAGE *pPage)
 	}
 	
 	pPage->iBackground = -1; /* unspecified */
+	pPage->iFrameCount = pPage->iLoopCount = 0; /* no acTL (yet) */
 	
     if (MOTOLONG(&s[12]) == 0x49484452UL/*'IHDR'*/) {
         pPage->iWidth = MOTOLONG(&s[16]);
@@ -71,7 +105,7 @@ static int PNGParseInfo(PNGIMAGE *pPage)
         pPage->ucPixelType = s[25]; // pixel type
         pPage->iInterlaced = s[28];
 		
-        if ((s[26] != 0) || (s[27] != 0) || pPage->iInterlaced) {
+        if ((s[26] != 0) || (s[27] != 0) || (pPage->iInterlaced > 1)) { // Adam7 is the one interlace method
             pPage->iError = PNG_UNSUPPORTED_FEATURE;
             return pPage->iError;
 		}
@@ -126,43 +160,461 @@ static int PNGParseInfo(PNGIMAGE *pPage)
     if (pPage->iPitch >= 65534)
        return PNG_TOO_BIG;
 
+	PNGSetFilters(pPage);
     return PNG_SUCCESS;
-}
+} /* PNGParseHeader() */
+
+//
+// Read the start of the file and parse its header
+//
+static int PNGParseInfo(PNGIMAGE *pPage)
+{
+    uint8_t *s = pPage->ucFileBuf; // left there for a streaming PNG_decode()
+    int32_t iBytesRead;
+
+    if (pPage->PNGFile.pData) { // in memory already, parse it in place
+        if (pPage->PNGFile.iSize < PNG_INFO_SIZE) {
+            pPage->iError = PNG_INVALID_FILE;
+            return pPage->iError;
+        }
+        return PNGParseHeader(pPage, pPage->PNGFile.pData);
+    }
+    // Read a few bytes to just parse the size/pixel info
+    pPage->PNGFile.iPos = 0; // the file is expected to be at its start
+    iBytesRead = PNGReadAt(pPage, 0, s, PNG_INFO_SIZE);
+    if (iBytesRead < PNG_INFO_SIZE) { // a PNG file this tiny? probably bad
+        pPage->iError = PNG_INVALID_FILE;
+        return pPage->iError;
+    }
+    return PNGParseHeader(pPage, s);
+} /* PNGParseInfo() */
+
+//
+// c over bg at alpha a: (c * a + bg * (255 - a)) / 255 rounded to nearest,
+// exact for every a, 0 and 255 included, without branching on a (the sum
+// and the rounding stay within 16 unsigned bits)
+//
+#define PNG_DIV255(x) (((x) + 128 + (((x) + 128) >> 8)) >> 8)
+#define PNG_BLEND255(c, bg, a) PNG_DIV255((unsigned)(c) * (a) + (unsigned)(bg) * (255 - (a)))
+
+//
+// Put the 8-bit RGB (N = 3) or RGBA (N = 4) pixel at p in the BGR line at o,
+// over the background ulBg (0xBBGGRR) where it is see-through; an RGB pixel
+// is when it is the tRNS color ulTrans
+//
+#define PNG_PUT_BGR(o, p, N, ulBg, ulTrans) \
+	do { \
+		unsigned a_ = ((N) == 4) ? (p)[3] : ((p)[0] == (uint8_t)(ulTrans) && (p)[1] == (uint8_t)((ulTrans) >> 8) && \
+			(p)[2] == ((ulTrans) >> 16)) ? 0 : 255; \
+		if (a_ == 255) { /* the same as blending it, only quicker */ \
+			(o)[0] = (p)[2]; \
+			(o)[1] = (p)[1]; \
+			(o)[2] = (p)[0]; \
+		} else { \
+			(o)[0] = (uint8_t)PNG_BLEND255((p)[2], ((ulBg) >> 16) & 0xff, a_); \
+			(o)[1] = (uint8_t)PNG_BLEND255((p)[1], ((ulBg) >> 8) & 0xff, a_); \
+			(o)[2] = (uint8_t)PNG_BLEND255((p)[0], (ulBg) & 0xff, a_); \
+		} \
+	} while (0)
+
+// On x86 Linux builds, lines of 3, 4, 6 or 8-byte pixels (and Up lines of
+// any) get SSE2 versions of the filters, with SSSE3 for Paeth when the CPU
+// has it, as found once at startup. They match the scalar loops bit for
+// bit (tests/defilter.c checks both against DeFilter()). A line wanted
+// as BGR goes through the SSSE3/AVX2 RGB(A) to BGR loop further down once
+// it is done, so there is one SIMD way of getting there.
+#if !defined(PNG_DEFILTER_SIMD) && defined(LINUX) && defined(__GNUC__) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define PNG_DEFILTER_SIMD
+#endif
+
+#ifdef PNG_DEFILTER_SIMD
+#include <immintrin.h>
+
+#define PNG_SSE2_INLINE static __inline__ __attribute__((always_inline, target("sse2")))
+
+//
+// A pixel of iBpp (3, 4, 6 or 8) bytes in the low bytes of a vector, and
+// back; with a constant iBpp these come down to a load or two
+//
+PNG_SSE2_INLINE __m128i PNGLoadPixel(const uint8_t *p, int iBpp)
+{
+	uint32_t u;
+
+	switch (iBpp) {
+		case 3:
+			return _mm_cvtsi32_si128(p[0] | (p[1] << 8) | (p[2] << 16));
+		case 4:
+			memcpy(&u, p, 4);
+			return _mm_cvtsi32_si128((int)u);
+		case 6:
+			memcpy(&u, p, 4);
+			return _mm_insert_epi16(_mm_cvtsi32_si128((int)u), p[4] | (p[5] << 8), 2);
+		default:
+			return _mm_loadl_epi64((const __m128i *)p);
+	}
+} /* PNGLoadPixel() */
+
+PNG_SSE2_INLINE void PNGStorePixel(uint8_t *p, __m128i v, int iBpp)
+{
+	uint32_t u = (uint32_t)_mm_cvtsi128_si32(v);
+
+	switch (iBpp) {
+		case 3:
+			p[0] = (uint8_t)u;
+			p[1] = (uint8_t)(u >> 8);
+			p[2] = (uint8_t)(u >> 16);
+			break;
+		case 4:
+			memcpy(p, &u, 4);
+			break;
+		case 6:
+			memcpy(p, &u, 4);
+			u = (uint32_t)_mm_extract_epi16(v, 2);
+			p[4] = (uint8_t)u;
+			p[5] = (uint8_t)(u >> 8);
+			break;
+		default:
+			_mm_storel_epi64((__m128i *)p, v);
+			break;
+	}
+} /* PNGStorePixel() */
+
+//
+// Sub and Avg go a pixel at a time, each one needs the one before it
+//
+PNG_SSE2_INLINE void PNGSubPixels(uint8_t *pCurr, const uint8_t *pSrc, int iBpp, int iPitch)
+{
+	__m128i a = _mm_setzero_si128();
+	int x;
+
+	for (x = 0; x < iPitch; x += iBpp) {
+		a = _mm_add_epi8(a, PNGLoadPixel(&pSrc[x], iBpp));
+		PNGStorePixel(&pCurr[x], a, iBpp);
+	}
+} /* PNGSubPixels() */
+
+PNG_SSE2_INLINE void PNGAvgPixels(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i a = _mm_setzero_si128(), b, avg;
+	int x;
+
+	for (x = 0; x < iPitch; x += iBpp) {
+		b = PNGLoadPixel(&pPrev[x], iBpp);
+		// pavgb rounds up, take the 1 back off where a + b is odd
+		avg = _mm_avg_epu8(a, b);
+		avg = _mm_sub_epi8(avg, _mm_and_si128(_mm_xor_si128(a, b), one));
+		a = _mm_add_epi8(avg, PNGLoadPixel(&pSrc[x], iBpp));
+		PNGStorePixel(&pCurr[x], a, iBpp);
+	}
+} /* PNGAvgPixels() */
+
+//
+// Paeth on 16-bit lanes, a pixel at a time: p - a = b - c, p - b = a - c and
+// p - c = (b - c) + (a - c); ties go to a, then b. The sum with the filtered
+// byte is done on bytes so it wraps, the high bytes stay 0 for packuswb.
+//
+#define PNG_PAETH_PIXELS(ABS16) \
+	const __m128i zero = _mm_setzero_si128(); \
+	__m128i a = zero, b, c = zero, d, pa, pb, pc, smallest, nearest, m; \
+	int x; \
+	for (x = 0; x < iPitch; x += iBpp) { \
+		b = _mm_unpacklo_epi8(PNGLoadPixel(&pPrev[x], iBpp), zero); \
+		d = _mm_unpacklo_epi8(PNGLoadPixel(&pSrc[x], iBpp), zero); \
+		pa = _mm_sub_epi16(b, c); \
+		pb = _mm_sub_epi16(a, c); \
+		pc = _mm_add_epi16(pa, pb); \
+		pa = ABS16(pa); \
+		pb = ABS16(pb); \
+		pc = ABS16(pc); \
+		smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb)); \
+		m = _mm_cmpeq_epi16(smallest, pb); \
+		nearest = _mm_or_si128(_mm_and_si128(m, b), _mm_andnot_si128(m, c)); \
+		m = _mm_cmpeq_epi16(smallest, pa); \
+		nearest = _mm_or_si128(_mm_and_si128(m, a), _mm_andnot_si128(m, nearest)); \
+		d = _mm_add_epi8(d, nearest); \
+		PNGStorePixel(&pCurr[x], _mm_packus_epi16(d, d), iBpp); \
+		c = b; \
+		a = d; \
+	}
+
+#define PNG_ABS16_SSE2(v) _mm_max_epi16(v, _mm_sub_epi16(zero, v))
+
+PNG_SSE2_INLINE void PNGPaethPixelsSSE2(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	PNG_PAETH_PIXELS(PNG_ABS16_SSE2)
+} /* PNGPaethPixelsSSE2() */
 
+static __inline__ __attribute__((always_inline, target("ssse3")))
+void PNGPaethPixelsSSSE3(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	PNG_PAETH_PIXELS(_mm_abs_epi16)
+} /* PNGPaethPixelsSSSE3() */
+
+//
+// The filters, each pixel size getting its own copy of the loop
+//
+__attribute__((target("sse2")))
+static void PNGSubSSE2(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	(void)pPrev;
+	switch (iBpp) {
+		case 3: PNGSubPixels(pCurr, pSrc, 3, iPitch); break;
+		case 4: PNGSubPixels(pCurr, pSrc, 4, iPitch); break;
+		case 6: PNGSubPixels(pCurr, pSrc, 6, iPitch); break;
+		default: PNGSubPixels(pCurr, pSrc, 8, iPitch); break;
+	}
+} /* PNGSubSSE2() */
+
+__attribute__((target("sse2")))
+static void PNGUpSSE2(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	int x;
+
+	(void)iBpp;
+	for (x = 0; x + 16 <= iPitch; x += 16)
+		_mm_storeu_si128((__m128i *)&pCurr[x], _mm_add_epi8(_mm_loadu_si128((const __m128i *)&pSrc[x]),
+			_mm_loadu_si128((const __m128i *)&pPrev[x])));
+	for (; x < iPitch; x++)
+		pCurr[x] = pSrc[x] + pPrev[x];
+} /* PNGUpSSE2() */
+
+__attribute__((target("sse2")))
+static void PNGAvgSSE2(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	switch (iBpp) {
+		case 3: PNGAvgPixels(pCurr, pSrc, pPrev, 3, iPitch); break;
+		case 4: PNGAvgPixels(pCurr, pSrc, pPrev, 4, iPitch); break;
+		case 6: PNGAvgPixels(pCurr, pSrc, pPrev, 6, iPitch); break;
+		default: PNGAvgPixels(pCurr, pSrc, pPrev, 8, iPitch); break;
+	}
+} /* PNGAvgSSE2() */
+
+__attribute__((target("sse2")))
+static void PNGPaethSSE2(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	switch (iBpp) {
+		case 3: PNGPaethPixelsSSE2(pCurr, pSrc, pPrev, 3, iPitch); break;
+		case 4: PNGPaethPixelsSSE2(pCurr, pSrc, pPrev, 4, iPitch); break;
+		case 6: PNGPaethPixelsSSE2(pCurr, pSrc, pPrev, 6, iPitch); break;
+		default: PNGPaethPixelsSSE2(pCurr, pSrc, pPrev, 8, iPitch); break;
+	}
+} /* PNGPaethSSE2() */
+
+__attribute__((target("ssse3")))
+static void PNGPaethSSSE3(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	switch (iBpp) {
+		case 3: PNGPaethPixelsSSSE3(pCurr, pSrc, pPrev, 3, iPitch); break;
+		case 4: PNGPaethPixelsSSSE3(pCurr, pSrc, pPrev, 4, iPitch); break;
+		case 6: PNGPaethPixelsSSSE3(pCurr, pSrc, pPrev, 6, iPitch); break;
+		default: PNGPaethPixelsSSSE3(pCurr, pSrc, pPrev, 8, iPitch); break;
+	}
+} /* PNGPaethSSSE3() */
+
+//
+// RGB and RGBA lines (iBpp 3, 4, 6 or 8 bytes a pixel) to BGR over the
+// background ulBg, 16 pixels at a time, with SSSE3 or else AVX2 doing the
+// blending; 16-bit samples are narrowed to their high bytes first. Bit
+// for bit PNG_PUT_BGR, which does the pixels left over at the end.
+//
+static const uint8_t pngToBGRShuffle[2][16] = {
+	{2, 1, 0, 5, 4, 3, 8, 7, 6, 11, 10, 9, 0x80, 0x80, 0x80, 0x80}, // RGB
+	{2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, 0x80, 0x80, 0x80, 0x80} // RGBA
+};
+
+// 16 bytes at p, or the high bytes of the 16 big-endian samples there
+PNG_SSE2_INLINE __m128i PNGLoad8(const uint8_t *p, int iWide)
+{
+	const __m128i lo = _mm_set1_epi16(0xff);
+
+	if (!iWide)
+		return _mm_loadu_si128((const __m128i *)p);
+	return _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i *)p), lo),
+		_mm_and_si128(_mm_loadu_si128((const __m128i *)(p + 16)), lo));
+} /* PNGLoad8() */
+
+#define PNG_MM128(f) _mm##f
+#define PNG_MM256(f) _mm256##f
+
+// The RGBA pixels in v (SI of W bits) over bg (its RGB0 on 16-bit lanes),
+// PNG_BLEND255 on 16-bit lanes: t * 257 >> 16 is the same as t + (t >> 8) >> 8
+#define PNG_BLEND_RGBA(SI, MM, W, v, bg) \
+	do { \
+		const SI zero_ = MM(_setzero_si##W)(), ff_ = MM(_set1_epi16)(255); \
+		SI c_, a_, r_[2]; \
+		int h_; \
+		for (h_ = 0; h_ < 2; h_++) { \
+			c_ = h_ ? MM(_unpackhi_epi8)(v, zero_) : MM(_unpacklo_epi8)(v, zero_); \
+			a_ = MM(_shufflehi_epi16)(MM(_shufflelo_epi16)(c_, 0xff), 0xff); \
+			r_[h_] = MM(_add_epi16)(MM(_mullo_epi16)(c_, a_), MM(_mullo_epi16)(bg, MM(_sub_epi16)(ff_, a_))); \
+			r_[h_] = MM(_mulhi_epu16)(MM(_add_epi16)(r_[h_], MM(_set1_epi16)(128)), MM(_set1_epi16)(257)); \
+		} \
+		v = MM(_packus_epi16)(r_[0], r_[1]); \
+	} while (0)
+
+#define PNG_BLEND4_SSSE3(v, bg) \
+	do { \
+		for (k = 0; k < 4; k++) \
+			PNG_BLEND_RGBA(__m128i, PNG_MM128, 128, v[k], bg); \
+	} while (0)
+
+#define PNG_BLEND4_AVX2(v, bg) \
+	do { \
+		__m256i w0 = _mm256_inserti128_si256(_mm256_castsi128_si256(v[0]), v[1], 1); \
+		__m256i w1 = _mm256_inserti128_si256(_mm256_castsi128_si256(v[2]), v[3], 1); \
+		__m256i bg2 = _mm256_broadcastsi128_si256(bg); \
+		PNG_BLEND_RGBA(__m256i, PNG_MM256, 256, w0, bg2); \
+		PNG_BLEND_RGBA(__m256i, PNG_MM256, 256, w1, bg2); \
+		v[0] = _mm256_castsi256_si128(w0); \
+		v[1] = _mm256_extracti128_si256(w0, 1); \
+		v[2] = _mm256_castsi256_si128(w1); \
+		v[3] = _mm256_extracti128_si256(w1, 1); \
+	} while (0)
+
+#define PNG_TO_BGR_PIXELS(BLEND4) \
+	const int iWide = (iBpp >= 6), iAlpha = (iBpp == 4 || iBpp == 8); \
+	const __m128i shuf = _mm_loadu_si128((const __m128i *)pngToBGRShuffle[iAlpha]); \
+	const __m128i opaque = _mm_set1_epi32((int)0xff000000); \
+	const __m128i bg = _mm_setr_epi16((short)(ulBg & 0xff), (short)((ulBg >> 8) & 0xff), (short)((ulBg >> 16) & 0xff), 0, \
+		(short)(ulBg & 0xff), (short)((ulBg >> 8) & 0xff), (short)((ulBg >> 16) & 0xff), 0); \
+	__m128i v[4], t; \
+	uint8_t p[4]; \
+	int x, k; \
+	for (x = 0; x + 16 <= iWidth; x += 16, pSrc += 16 * iBpp, pBGR += 48) { \
+		/* v[k] = pixels 4k to 4k + 3, RGB in the low 12 bytes or RGBA */ \
+		if (iAlpha) { \
+			for (k = 0; k < 4; k++) \
+				v[k] = PNGLoad8(pSrc + 4 * k * iBpp, iWide); \
+			t = _mm_and_si128(_mm_and_si128(v[0], v[1]), _mm_and_si128(v[2], v[3])); \
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(t, opaque), opaque)) != 0xffff) \
+				BLEND4(v, bg); \
+		} else { \
+			v[0] = PNGLoad8(pSrc, iWide); \
+			v[1] = PNGLoad8(pSrc + 16 * iBpp / 3, iWide); \
+			v[2] = PNGLoad8(pSrc + 32 * iBpp / 3, iWide); \
+			v[3] = _mm_srli_si128(v[2], 4); \
+			v[2] = _mm_alignr_epi8(v[2], v[1], 8); \
+			v[1] = _mm_alignr_epi8(v[1], v[0], 12); \
+		} \
+		for (k = 0; k < 4; k++) \
+			v[k] = _mm_shuffle_epi8(v[k], shuf); \
+		_mm_storeu_si128((__m128i *)pBGR, _mm_or_si128(v[0], _mm_slli_si128(v[1], 12))); \
+		_mm_storeu_si128((__m128i *)(pBGR + 16), _mm_or_si128(_mm_srli_si128(v[1], 4), _mm_slli_si128(v[2], 8))); \
+		_mm_storeu_si128((__m128i *)(pBGR + 32), _mm_or_si128(_mm_srli_si128(v[2], 8), _mm_slli_si128(v[3], 4))); \
+	} \
+	for (; x < iWidth; x++, pSrc += iBpp, pBGR += 3) { \
+		for (k = 0; k < 3 + iAlpha; k++) \
+			p[k] = pSrc[k << iWide]; \
+		if (iAlpha) \
+			PNG_PUT_BGR(pBGR, p, 4, ulBg, 0); \
+		else \
+			PNG_PUT_BGR(pBGR, p, 3, ulBg, 0xffffffffUL); \
+	}
+
+static __inline__ __attribute__((always_inline, target("ssse3")))
+void PNGToBGRPixelsSSSE3(uint8_t *pBGR, const uint8_t *pSrc, int iBpp, int iWidth, uint32_t ulBg)
+{
+	PNG_TO_BGR_PIXELS(PNG_BLEND4_SSSE3)
+} /* PNGToBGRPixelsSSSE3() */
+
+static __inline__ __attribute__((always_inline, target("avx2")))
+void PNGToBGRPixelsAVX2(uint8_t *pBGR, const uint8_t *pSrc, int iBpp, int iWidth, uint32_t ulBg)
+{
+	PNG_TO_BGR_PIXELS(PNG_BLEND4_AVX2)
+} /* PNGToBGRPixelsAVX2() */
+
+__attribute__((target("ssse3")))
+static void PNGToBGRSSSE3(uint8_t *pBGR, const uint8_t *pSrc, int iBpp, int iWidth, uint32_t ulBg)
+{
+	switch (iBpp) {
+		case 3: PNGToBGRPixelsSSSE3(pBGR, pSrc, 3, iWidth, ulBg); break;
+		case 4: PNGToBGRPixelsSSSE3(pBGR, pSrc, 4, iWidth, ulBg); break;
+		case 6: PNGToBGRPixelsSSSE3(pBGR, pSrc, 6, iWidth, ulBg); break;
+		default: PNGToBGRPixelsSSSE3(pBGR, pSrc, 8, iWidth, ulBg); break;
+	}
+} /* PNGToBGRSSSE3() */
+
+// (RGB lines are no work to speak of, SSSE3 has them)
+__attribute__((target("avx2")))
+static void PNGToBGRAVX2(uint8_t *pBGR, const uint8_t *pSrc, int iBpp, int iWidth, uint32_t ulBg)
+{
+	if (iBpp == 4)
+		PNGToBGRPixelsAVX2(pBGR, pSrc, 4, iWidth, ulBg);
+	else if (iBpp == 8)
+		PNGToBGRPixelsAVX2(pBGR, pSrc, 8, iWidth, ulBg);
+	else
+		PNGToBGRSSSE3(pBGR, pSrc, iBpp, iWidth, ulBg);
+} /* PNGToBGRAVX2() */
+
+// the best of the above for this CPU by filter type, NULL for the scalar code
+static PNG_DEFILTER_FUNC *pngDefilterSimd[PNG_FILTER_COUNT];
+// and the RGB(A) to BGR line loop
+static void (*pngToBGRSimd)(uint8_t *pBGR, const uint8_t *pSrc, int iBpp, int iWidth, uint32_t ulBg);
+
+static void PNGDefilterSimdInit(void) __attribute__((constructor));
+
+static void PNGDefilterSimdInit(void)
+{
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("sse2"))
+		return;
+	pngDefilterSimd[PNG_FILTER_SUB] = PNGSubSSE2;
+	pngDefilterSimd[PNG_FILTER_UP] = PNGUpSSE2;
+	pngDefilterSimd[PNG_FILTER_AVG] = PNGAvgSSE2;
+	if (__builtin_cpu_supports("ssse3")) {
+		pngToBGRSimd = __builtin_cpu_supports("avx2") ? PNGToBGRAVX2 : PNGToBGRSSSE3;
+		pngDefilterSimd[PNG_FILTER_PAETH] = PNGPaethSSSE3;
+	} else {
+		pngDefilterSimd[PNG_FILTER_PAETH] = PNGPaethSSE2;
+	}
+} /* PNGDefilterSimdInit() */
+#endif // PNG_DEFILTER_SIMD
+
+#ifdef PNG_TEST
 //
-// De-filter the current line of pixels
+// De-filter the current line of pixels, the reference tests/defilter.c
+// checks the loops PNGSetFilters() picks against
+// (pSrc is the line as inflated, pCurr can be the same line to do it in place)
 //
-PNG_STATIC void DeFilter(uint8_t *pCurr, uint8_t *pPrev, int iWidth, int iPitch)
+PNG_STATIC void DeFilter(uint8_t *pCurr, uint8_t *pSrc, uint8_t *pPrev, int iWidth, int iPitch)
 {
-    uint8_t ucFilter = *pCurr++;
+    uint8_t ucFilter = *pSrc++;
     int x, iBpp;
     if (iPitch <= iWidth)
         iBpp = 1;
     else
         iBpp = iPitch / iWidth;
     
+    *pCurr++ = ucFilter;
     pPrev++; // skip filter of previous line
     switch (ucFilter) { // switch on filter type
         case PNG_FILTER_NONE:
             // nothing to do :)
+            if (pCurr != pSrc)
+                memcpy(pCurr, pSrc, iPitch);
             break;
         case PNG_FILTER_SUB:
+            for (x = 0; x < iBpp; x++) {
+                pCurr[x] = pSrc[x];
+            }
             for (x=iBpp; x<iPitch; x++) {
-                pCurr[x] += pCurr[x-iBpp];
+                pCurr[x] = pSrc[x] + pCurr[x-iBpp];
             }
             break;
         case PNG_FILTER_UP:
 	    for (x = 0; x < iPitch; x++) {
-               pCurr[x] += pPrev[x];
+               pCurr[x] = pSrc[x] + pPrev[x];
             }
             break;
         case PNG_FILTER_AVG:
             for (x = 0; x < iBpp; x++) {
-               pCurr[x] = (pCurr[x] +
+               pCurr[x] = (pSrc[x] +
                   pPrev[x] / 2 );
             }
             for (x = iBpp; x < iPitch; x++) {
-               pCurr[x] = pCurr[x] +
+               pCurr[x] = pSrc[x] +
                   (pPrev[x] + pCurr[x-iBpp]) / 2;
             }
             break;
@@ -172,7 +624,7 @@ PNG_STATIC void DeFilter(uint8_t *pCurr, uint8_t *pPrev, int iWidth, int iPitch)
                 uint8_t *pEnd = &pCurr[iPitch];
                 // First pixel/byte
                 c = *pPrev++;
-                a = *pCurr + c;
+                a = *pSrc++ + c;
                 *pCurr++ = (uint8_t)a;
                 while (pCurr < pEnd) {
                    int b, pa, pb, pc, p;
@@ -191,14 +643,14 @@ PNG_STATIC void DeFilter(uint8_t *pCurr, uint8_t *pPrev, int iWidth, int iPitch)
                    if (pc < pa) a = c;
                    // Calculate current pixel
                    c = b;
-                   a += *pCurr;
+                   a += *pSrc++;
                    *pCurr++ = (uint8_t)a;
                 }
             } else { // multi-byte
                 uint8_t *pEnd = &pCurr[iBpp];
                 // first pixel is treated the same as 'up'
 		while (pCurr < pEnd) {
-                   int a = *pCurr + *pPrev++;
+                   int a = *pSrc++ + *pPrev++;
                    *pCurr++ = (uint8_t)a;
                 }
                 pEnd = pEnd + (iPitch - iBpp);
@@ -217,296 +669,2003 @@ PNG_STATIC void DeFilter(uint8_t *pCurr, uint8_t *pPrev, int iWidth, int iPitch)
                       pa = pb; a = b;
                    }
                    if (pc < pa) a = c;
-                   a += *pCurr;
+                   a += *pSrc++;
                    *pCurr++ = (uint8_t)a;
                 }
             } // multi-byte
             break;
     } // switch on filter type
 } /* DeFilter() */
+#endif // PNG_TEST
+
 //
-// PNGInit
-// Parse the PNG file header and confirm that it's a valid file
-//
-// returns 0 for success, nonzero for failure
+// The filters, a loop for each filter type and pixel size
+// (N bytes, 1 for less than a byte) so that the pixel size is a constant
 //
-int PNG_init(PNGIMAGE *pPNG)
+static void PNGNone(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
 {
-    return PNGParseInfo(pPNG); // gather info for image
-} /* PNG_init() */
+	(void)pPrev; (void)iBpp;
+	if (pCurr != pSrc)
+		memcpy(pCurr, pSrc, iPitch);
+} /* PNGNone() */
+
+static void PNGUp(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch)
+{
+	int x;
+
+	(void)iBpp;
+	for (x = 0; x < iPitch; x++)
+		pCurr[x] = pSrc[x] + pPrev[x];
+} /* PNGUp() */
 
+#define PNG_DEFILTERS(N) \
+static void PNGSub##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch) \
+{ \
+	int x; \
+	(void)pPrev; (void)iBpp; \
+	for (x = 0; x < N && x < iPitch; x++) \
+		pCurr[x] = pSrc[x]; \
+	for (; x < iPitch; x++) \
+		pCurr[x] = pSrc[x] + pCurr[x - N]; \
+} \
+static void PNGAvg##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch) \
+{ \
+	int x; \
+	(void)iBpp; \
+	for (x = 0; x < N && x < iPitch; x++) \
+		pCurr[x] = pSrc[x] + pPrev[x] / 2; \
+	for (; x < iPitch; x++) \
+		pCurr[x] = pSrc[x] + (pPrev[x] + pCurr[x - N]) / 2; \
+} \
+static void PNGPaeth##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch) \
+{ \
+	int x, a, b, c, p, pa, pb, pc; \
+	(void)iBpp; \
+	for (x = 0; x < N && x < iPitch; x++) /* the first pixel is treated the same as 'up' */ \
+		pCurr[x] = pSrc[x] + pPrev[x]; \
+	for (; x < iPitch; x++) { \
+		a = pCurr[x - N]; \
+		b = pPrev[x]; \
+		c = pPrev[x - N]; \
+		p = b - c; \
+		pc = a - c; \
+		pa = p < 0 ? -p : p; \
+		pb = pc < 0 ? -pc : pc; \
+		pc = (p + pc) < 0 ? -(p + pc) : p + pc; \
+		if (pb < pa) { \
+			pa = pb; a = b; \
+		} \
+		if (pc < pa) a = c; \
+		pCurr[x] = (uint8_t)(a + pSrc[x]); \
+	} \
+}
 
+PNG_DEFILTERS(1)
+PNG_DEFILTERS(2)
+PNG_DEFILTERS(3)
+PNG_DEFILTERS(4)
+PNG_DEFILTERS(6)
+PNG_DEFILTERS(8)
 
+#ifndef PNG_DEFILTER_SIMD
 //
-// Decode the PNG file
+// And for 8-bit RGB and RGBA, a pixel at a time, each one going into the
+// BGR line as soon as it is done (see PNG_DEFILTER_BGR_FUNC); left of the
+// first pixel, and above left of it, is 0. Now the fallback for builds
+// without PNG_DEFILTER_SIMD, which filter the line and then convert it.
 //
-// You must call open() before calling decode()
-// This function can be called repeatedly without having
-// to close and re-open the file
+static const uint8_t pngZeros[4] = {0, 0, 0, 0};
+
+#define PNG_DEFILTERS_BGR(N) \
+static void PNGNoneBGR##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch, \
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans) \
+{ \
+	int x, k; \
+	(void)pPrev; (void)iBpp; \
+	for (x = 0; x < iPitch; x += N, pBGR += 3) { \
+		for (k = 0; k < N; k++) \
+			pCurr[x + k] = pSrc[x + k]; \
+		PNG_PUT_BGR(pBGR, &pCurr[x], N, ulBg, ulTrans); \
+	} \
+} \
+static void PNGSubBGR##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch, \
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans) \
+{ \
+	const uint8_t *pLeft = pngZeros; \
+	int x, k; \
+	(void)pPrev; (void)iBpp; \
+	for (x = 0; x < iPitch; x += N, pBGR += 3) { \
+		for (k = 0; k < N; k++) \
+			pCurr[x + k] = pSrc[x + k] + pLeft[k]; \
+		pLeft = &pCurr[x]; \
+		PNG_PUT_BGR(pBGR, pLeft, N, ulBg, ulTrans); \
+	} \
+} \
+static void PNGUpBGR##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch, \
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans) \
+{ \
+	int x, k; \
+	(void)iBpp; \
+	for (x = 0; x < iPitch; x += N, pBGR += 3) { \
+		for (k = 0; k < N; k++) \
+			pCurr[x + k] = pSrc[x + k] + pPrev[x + k]; \
+		PNG_PUT_BGR(pBGR, &pCurr[x], N, ulBg, ulTrans); \
+	} \
+} \
+static void PNGAvgBGR##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch, \
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans) \
+{ \
+	const uint8_t *pLeft = pngZeros; \
+	int x, k; \
+	(void)iBpp; \
+	for (x = 0; x < iPitch; x += N, pBGR += 3) { \
+		for (k = 0; k < N; k++) \
+			pCurr[x + k] = pSrc[x + k] + (pPrev[x + k] + pLeft[k]) / 2; \
+		pLeft = &pCurr[x]; \
+		PNG_PUT_BGR(pBGR, pLeft, N, ulBg, ulTrans); \
+	} \
+} \
+static void PNGPaethBGR##N(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch, \
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans) \
+{ \
+	const uint8_t *pLeft = pngZeros, *pUpLeft = pngZeros; \
+	int x, k, a, b, c, p, pa, pb, pc; \
+	(void)iBpp; \
+	for (x = 0; x < iPitch; x += N, pBGR += 3) { \
+		for (k = 0; k < N; k++) { \
+			a = pLeft[k]; \
+			b = pPrev[x + k]; \
+			c = pUpLeft[k]; \
+			p = b - c; \
+			pc = a - c; \
+			pa = p < 0 ? -p : p; \
+			pb = pc < 0 ? -pc : pc; \
+			pc = (p + pc) < 0 ? -(p + pc) : p + pc; \
+			if (pb < pa) { \
+				pa = pb; a = b; \
+			} \
+			if (pc < pa) a = c; \
+			pCurr[x + k] = (uint8_t)(a + pSrc[x + k]); \
+		} \
+		pLeft = &pCurr[x]; \
+		pUpLeft = &pPrev[x]; \
+		PNG_PUT_BGR(pBGR, pLeft, N, ulBg, ulTrans); \
+	} \
+}
+
+PNG_DEFILTERS_BGR(3)
+PNG_DEFILTERS_BGR(4)
+#endif // !PNG_DEFILTER_SIMD
+
+//
+// Pick the filter loops for the image's pixel size (IHDR is parsed)
 //
+static void PNGSetFilters(PNGIMAGE *pPage)
+{
+	PNG_DEFILTER_FUNC **pf = pPage->pfnDeFilter;
+	PNG_DEFILTER_BGR_FUNC **pb = pPage->pfnDeFilterBGR;
+	int f;
 
-int PNG_decode(PNGIMAGE *pPage, long User, int iOptions)
+	switch (pPage->ucPixelType) {
+		case PNG_PIXEL_TRUECOLOR:
+			pPage->iFilterBpp = 3 * pPage->ucBpp / 8;
+			break;
+		case PNG_PIXEL_GRAY_ALPHA:
+			pPage->iFilterBpp = 2 * pPage->ucBpp / 8;
+			break;
+		case PNG_PIXEL_TRUECOLOR_ALPHA:
+			pPage->iFilterBpp = 4 * pPage->ucBpp / 8;
+			break;
+		default: // grayscale, indexed
+			pPage->iFilterBpp = (pPage->ucBpp > 8) ? 2 : 1;
+			break;
+	}
+	pf[PNG_FILTER_NONE] = PNGNone;
+	pf[PNG_FILTER_UP] = PNGUp;
+	switch (pPage->iFilterBpp) {
+		case 1: pf[PNG_FILTER_SUB] = PNGSub1; pf[PNG_FILTER_AVG] = PNGAvg1; pf[PNG_FILTER_PAETH] = PNGPaeth1; break;
+		case 2: pf[PNG_FILTER_SUB] = PNGSub2; pf[PNG_FILTER_AVG] = PNGAvg2; pf[PNG_FILTER_PAETH] = PNGPaeth2; break;
+		case 3: pf[PNG_FILTER_SUB] = PNGSub3; pf[PNG_FILTER_AVG] = PNGAvg3; pf[PNG_FILTER_PAETH] = PNGPaeth3; break;
+		case 4: pf[PNG_FILTER_SUB] = PNGSub4; pf[PNG_FILTER_AVG] = PNGAvg4; pf[PNG_FILTER_PAETH] = PNGPaeth4; break;
+		case 6: pf[PNG_FILTER_SUB] = PNGSub6; pf[PNG_FILTER_AVG] = PNGAvg6; pf[PNG_FILTER_PAETH] = PNGPaeth6; break;
+		default: pf[PNG_FILTER_SUB] = PNGSub8; pf[PNG_FILTER_AVG] = PNGAvg8; pf[PNG_FILTER_PAETH] = PNGPaeth8; break;
+	}
+	for (f = 0; f < PNG_FILTER_COUNT; f++)
+		pb[f] = NULL;
+#ifdef PNG_DEFILTER_SIMD
+	for (f = PNG_FILTER_SUB; f < PNG_FILTER_COUNT; f++) {
+		if (pngDefilterSimd[f] && (f == PNG_FILTER_UP || pPage->iFilterBpp >= 3))
+			pf[f] = pngDefilterSimd[f];
+	}
+#else
+	if (pPage->ucBpp == 8 && pPage->iFilterBpp == 3) {
+		pb[PNG_FILTER_NONE] = PNGNoneBGR3; pb[PNG_FILTER_SUB] = PNGSubBGR3; pb[PNG_FILTER_UP] = PNGUpBGR3;
+		pb[PNG_FILTER_AVG] = PNGAvgBGR3; pb[PNG_FILTER_PAETH] = PNGPaethBGR3;
+	} else if (pPage->ucBpp == 8 && pPage->ucPixelType == PNG_PIXEL_TRUECOLOR_ALPHA) {
+		pb[PNG_FILTER_NONE] = PNGNoneBGR4; pb[PNG_FILTER_SUB] = PNGSubBGR4; pb[PNG_FILTER_UP] = PNGUpBGR4;
+		pb[PNG_FILTER_AVG] = PNGAvgBGR4; pb[PNG_FILTER_PAETH] = PNGPaethBGR4;
+	}
+#endif
+} /* PNGSetFilters() */
+
+//
+// De-filter a line of iPitch bytes with the loops PNGSetFilters() picked
+// (pCurr can be pSrc to do it in place), and with a pBGR line put it there
+// as BMP pixels on the way if the image is 8-bit truecolor.
+// Returns pBGR if it did, NULL if not (or if the filter byte is no filter
+// at all, which is a PNG_DECODE_ERROR that stops the decode).
+//
+static uint8_t *PNGDeFilterLine(PNGIMAGE *pPage, uint8_t *pCurr, uint8_t *pSrc, uint8_t *pPrev, int iPitch, uint8_t *pBGR)
 {
-	int more = 0;
-    int err, y;
-    int iBytesRead;
-	int32_t iOffset; /* Needs to be i32 to allow us to skip >32k chunks (iLen can be added to it) */
-	int32_t iLen=0;
-	off_t iFileOffset;
-    uint32_t iMarker=0;
-    uint8_t *pCurr, *pPrev;
-    z_stream d_stream; /* decompression stream */
-    uint8_t *s = pPage->ucFileBuf;
-    struct inflate_state *state;
-	
-	int hbo = 1; /* highest bits offset, for bKGD and tRNS chunks - 0 for 16bit bpp */
-	
-    // we need the draw callback and the linebuffers
-    if ((pPage->pfnDraw == NULL)||(pPage->uLine1 == NULL)||(pPage->uLine2 == NULL)) {
-		pPage->iError = PNG_NO_BUFFER;
-		return pPage->iError;
+	uint8_t ucFilter = *pSrc;
+	uint32_t ulBg, ulTrans;
+
+	*pCurr = ucFilter;
+	if (ucFilter >= PNG_FILTER_COUNT) {
+		pPage->iError = PNG_DECODE_ERROR;
+		return NULL;
+	}
+#ifdef PNG_DEFILTER_SIMD
+	// the done line goes through pngToBGRSimd, for 8-bit truecolor when
+	// the CPU has SSSE3
+	(*pPage->pfnDeFilter[ucFilter])(pCurr + 1, pSrc + 1, pPrev + 1, pPage->iFilterBpp, iPitch);
+	if (pBGR == NULL || pngToBGRSimd == NULL || pPage->ucBpp != 8 ||
+	    (pPage->ucPixelType != PNG_PIXEL_TRUECOLOR && pPage->ucPixelType != PNG_PIXEL_TRUECOLOR_ALPHA))
+		return NULL;
+#else
+	if (pBGR == NULL || pPage->pfnDeFilterBGR[ucFilter] == NULL) {
+		(*pPage->pfnDeFilter[ucFilter])(pCurr + 1, pSrc + 1, pPrev + 1, pPage->iFilterBpp, iPitch);
+		return NULL;
 	}
+#endif
+	// (bKGD can come after the first IDAT in a stream, so this is per line)
+	ulBg = (pPage->iBGRBackground >= 0) ? (uint32_t)pPage->iBGRBackground : pPage->iBackground;
+	ulTrans = 0xffffffffUL;
+	if (pPage->ucPixelType == PNG_PIXEL_TRUECOLOR && pPage->iTransLen == 3)
+		ulTrans = pPage->iTrans[0] | ((uint32_t)pPage->iTrans[1] << 8) | ((uint32_t)pPage->iTrans[2] << 16);
+#ifdef PNG_DEFILTER_SIMD
+	// (a tRNS color to look for is left to the caller's convert)
+	if (ulTrans != 0xffffffffUL)
+		return NULL;
+	(*pngToBGRSimd)(pBGR, pCurr + 1, pPage->iFilterBpp, iPitch / pPage->iFilterBpp, ulBg);
+#else
+	(*pPage->pfnDeFilterBGR[ucFilter])(pCurr + 1, pSrc + 1, pPrev + 1, pPage->iFilterBpp, iPitch, pBGR, ulBg, ulTrans);
+#endif
+	return pBGR;
+} /* PNGDeFilterLine() */
+//
+// Parse one of the ancillary chunks we care about (PLTE, tRNS, bKGD)
+// p points to the chunk data, iLen bytes of it
+//
+static void PNGParseChunk(PNGIMAGE *pPage, uint32_t iMarker, uint8_t *p, int32_t iLen)
+{
+	int hbo = 1; /* highest bits offset, for bKGD and tRNS chunks - 0 for 16bit bpp */
 
-    // buffers to maintain the current and previous lines
-	pCurr = pPage->uLine1;
-	pPrev = pPage->uLine2;
-		
-    pPage->iError = PNG_SUCCESS;
-    // Inflate the compressed image data
-    // The allocation functions are disabled and zlib has been modified
-    // to not use malloc/free and instead the buffer is part of the PNG class
-    d_stream.zalloc = (alloc_func)0;
-    d_stream.zfree = (free_func)0;
-    d_stream.opaque = (voidpf)0;
-    // Insert the memory pointer here to avoid having to use malloc() inside zlib
-    state = (struct inflate_state FAR *)pPage->ucZLIB;
-    d_stream.state = (struct internal_state FAR *)state;
-    state->window = &pPage->ucZLIB[sizeof(struct inflate_state)]; // point to 32k dictionary buffer
-    err = inflateInit(&d_stream);
-    
-    iFileOffset = 8; // skip PNG file signature
-    iOffset = 0; // internal buffer offset starts at 0
-    (*pPage->pfnSeek)(&pPage->PNGFile, iFileOffset);
-	iBytesRead = 0;
-    y = 0;
-    d_stream.avail_out = 0;
-    d_stream.next_out = 0;
 	if (pPage->ucBpp > 8) hbo = 0;
-	
-    while ((!pPage->iError)&&(y < pPage->iHeight)) { // continue until fully decoded
-		int32_t left = iBytesRead - iOffset;
-        if ((left < 8)||(more)) { // need to read more data
-			//printf("left %d more %d Offset %d\n", left, more, iOffset);
-			if (left > 0) {
-				memmove(s, s+iOffset, left);
-			} else {
-				/* This is the case where we skip some file data. (-= left which is negative -> adds to iFileOffset) */
-				iFileOffset -= left;
-				left = 0;
-			}
-            (*pPage->pfnSeek)(&pPage->PNGFile, iFileOffset);
-            iBytesRead = (*pPage->pfnRead)(&pPage->PNGFile, s+left, PNG_FILE_BUF_SIZE - left);
-			if (iBytesRead < 0) {
-				pPage->iError = PNG_IO_ERROR;
-				break;
+	switch (iMarker)
+	{
+		case 0x624b4744: // 'bKGD'
+			switch (pPage->ucPixelType) {
+				case PNG_PIXEL_INDEXED:
+					if (iLen < 1) break;
+					pPage->iBackground = p[0];
+					break;
+				case PNG_PIXEL_GRAYSCALE: 
+				case PNG_PIXEL_GRAY_ALPHA:
+					if (iLen < 2) break;
+					pPage->iBackground = p[hbo];
+					break;
+
+				case PNG_PIXEL_TRUECOLOR: // truecolor + alpha
+				case PNG_PIXEL_TRUECOLOR_ALPHA: // truecolor + alpha
+					if (iLen < 6) break;
+					pPage->iBackground = p[0+hbo]; // lower part of 2-byte value is transparent color value
+					pPage->iBackground |= (p[2+hbo] << 8);
+					pPage->iBackground |= (p[4+hbo] << 16);
+					break;
 			}
-            iFileOffset += iBytesRead;
-			iBytesRead += left;
-            iOffset = 0;
-			more = 0;
-			/*
-			printf("iFO %ld BR %d\n", iFileOffset, iBytesRead);
-			printf("%02X %02X %02X %02X  %02X %02X %02X %02X  - %02X %02X %02X %02X  %02X %02X %02X %02X\n",
-				s[0x0], s[0x1],s[0x2],s[0x3],s[0x4],s[0x5],s[0x6],s[0x7],s[0x8],s[0x9],s[0xA],s[0xB],s[0xC],s[0xD],s[0xE],s[0xF]); */
-			/* We didn't get enough to parse a chunk, file ended before output finished. */
-			if (iBytesRead < 8) {
+			break;
+
+		case 0x504c5445: //'PLTE' palette colors
+			if ((iLen > 768)||(iLen%3)) {
 				pPage->iError = PNG_DECODE_ERROR;
-				//printf("decode1\n");
 				break;
-			}
-
-		}
+			}					
+			pPage->iPaletteCnt = iLen/3;
+			memcpy(pPage->ucPalette, p, iLen);
+			memset(&pPage->ucPalette[768], 0xff, 256); // assume all colors are opaque unless specified
+			break;
+		case 0x74524e53: //'tRNS' transparency info
+			if (pPage->ucPixelType == PNG_PIXEL_INDEXED) // if palette exists
+			{
+				if (iLen > 256) {
+					pPage->iError = PNG_DECODE_ERROR;
+					break;
+				}
 
-		if (!iMarker) {
-			iLen = MOTOLONG(&s[iOffset]); // chunk length
-			//printf("zMark iL %d Offset %d\n", iLen, iOffset);
-			if (iLen < 0 || iLen + (iFileOffset - iBytesRead) > pPage->PNGFile.iSize) // invalid data
+				memcpy(&pPage->ucPalette[768], p, iLen);
+				pPage->iHasAlpha = 1;
+			}
+			else if (iLen == 2) // for grayscale images
 			{
+				if (pPage->ucBpp > 8) {
+					memcpy(pPage->iTrans, p, 2);
+					pPage->iTransLen = 2;
+				} else {
+					pPage->iTrans[0] = p[1];
+					pPage->iTransLen = 1;
+				}
+			}
+			else if (iLen == 6) // transparent color for 24-bpp image
+			{
+				if (pPage->ucBpp > 8) {
+					memcpy(pPage->iTrans, p, 6);
+					pPage->iTransLen = 6;
+				} else {
+					pPage->iTrans[0] = p[1];
+					pPage->iTrans[1] = p[3];
+					pPage->iTrans[2] = p[5];
+					pPage->iTransLen = 3;
+				}
+			}
+			break;
+		case 0x6163544c: //'acTL' APNG animation control
+			if (iLen < 8 || MOTOLONG(p) == 0 || MOTOLONG(p) > 0x7fffffffUL) {
 				pPage->iError = PNG_DECODE_ERROR;
-				//printf("decode2\n");
 				break;
 			}
-			iMarker = MOTOLONG(&s[iOffset+4]);
-			iOffset += 8; // point to the marker data
-		}
+			pPage->iFrameCount = (int32_t)MOTOLONG(p);
+			pPage->iLoopCount = (int32_t)(MOTOLONG(&p[4]) & 0x7fffffffUL);
+			break;
+	} // switch
+} /* PNGParseChunk() */
 
-		/* Skip unknown chunks (by ... not skipping if one of the later-handled ones.) */
-		switch (iMarker) {
-            case 0x504c5445: //'PLTE' palette colors
-			case 0x74524e53: //'tRNS' transparency info
-            case 0x49444154: //'IDAT' image data block
-			case 0x44474b62: //'bKGD' background color
-				break;
-			default:
-				iMarker = 0;
-				iOffset += (iLen + 4); // skip data + CRC
-				break;
-		}
-		
-		if (!iMarker)
-			continue;
+//
+// Hand iRows defiltered lines (iPitch+1 bytes apart from pLine on) over to
+// the draw callback; what stays the same from line to line is filled in
+// with the first ones
+//
+static void PNGDrawLines(PNGIMAGE *pPage, uint8_t *pLine, uint8_t *pBGR, int y, int iRows, int iPass)
+{
+	PNGDRAW *pd = &pPage->run.draw;
 
-		left = iBytesRead - iOffset;
-		
-		/* Check that we have enough data for the chunk, if it is not IDAT. */
-		if ((iMarker != 0x49444154) && (left < iLen)) {
-			/* If it were impossible to fetch this chunk into our buffer, abort. */
-			if (iLen > PNG_FILE_BUF_SIZE) {
-				pPage->iError = PNG_DECODE_ERROR;
-				break;
-			}
-			more = 1;
-			continue;
-		}
-		
-        switch (iMarker)
-        {
-			case 0x44474b62: // 'bKGD'
-				switch (pPage->ucPixelType) {
-					case PNG_PIXEL_INDEXED:
-						pPage->iBackground = s[iOffset];
-						break;
-					case PNG_PIXEL_GRAYSCALE: 
-					case PNG_PIXEL_GRAY_ALPHA:
-						pPage->iBackground = s[iOffset+hbo];
-						break;
-						
-					case PNG_PIXEL_TRUECOLOR: // truecolor + alpha
-					case PNG_PIXEL_TRUECOLOR_ALPHA: // truecolor + alpha
-						pPage->iBackground = s[iOffset + 0+hbo]; // lower part of 2-byte value is transparent color value
-						pPage->iBackground |= (s[iOffset + 2+hbo] << 8);
-						pPage->iBackground |= (s[iOffset + 4+hbo] << 16);
-						break;
-				}
-				break;
+	if (pd->pPalette == NULL) {
+		pd->User = pPage->run.User;
+		pd->iPitch = pPage->iPitch;
+		pd->iStride = pPage->iPitch + 1;
+		pd->iWidth = pPage->iWidth;
+		pd->iPaletteCnt = pPage->iPaletteCnt;
+		pd->pPalette = pPage->ucPalette;
+		pd->iPixelType = pPage->ucPixelType;
+		pd->iHasAlpha = pPage->iHasAlpha;
+		pd->iBpp = pPage->ucBpp;
+		pd->iBackground = pPage->iBackground;
+		pd->iTransLen = pPage->iTransLen;
+		if (pd->iTransLen)
+			memcpy(pd->iTrans, pPage->iTrans, pd->iTransLen);
+	}
+	pd->pPixels = pLine + 1;
+	pd->pBGR = pBGR;
+	pd->y = y;
+	pd->iRows = iRows;
+	pd->iPass = iPass;
+	(*pPage->pfnDraw)(pd);
+} /* PNGDrawLines() */
 
-            case 0x504c5445: //'PLTE' palette colors
-				if ((iLen > 768)||(iLen%3)) {
-					pPage->iError = PNG_DECODE_ERROR;
-					break;
-				}					
-				pPage->iPaletteCnt = iLen/3;
-                memcpy(pPage->ucPalette, &s[iOffset], iLen);
-                memset(&pPage->ucPalette[768], 0xff, 256); // assume all colors are opaque unless specified
-				iMarker = 0;
-                break;
-			case 0x74524e53: //'tRNS' transparency info
-                if (pPage->ucPixelType == PNG_PIXEL_INDEXED) // if palette exists
-                {
-					if (iLen > 256) {
-						pPage->iError = PNG_DECODE_ERROR;
-						break;
-					}
+//
+// Draw the lines waiting in pDrawRows
+//
+static void PNGDrawRows(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
 
-					memcpy(&pPage->ucPalette[768], &s[iOffset], iLen);
-                    pPage->iHasAlpha = 1;
-                }
-                else if (iLen == 2) // for grayscale images
-                {
-					if (pPage->ucBpp > 8) {
-						memcpy(pPage->iTrans, &(s[iOffset]), 2);
-						pPage->iTransLen = 2;
-					} else {
-						pPage->iTrans[0] = s[iOffset+1];
-						pPage->iTransLen = 1;
-					}
-                }
-                else if (iLen == 6) // transparent color for 24-bpp image
-                {
-					if (pPage->ucBpp > 8) {
-						memcpy(pPage->iTrans, &(s[iOffset]), 6);
-						pPage->iTransLen = 6;
-					} else {
-						pPage->iTrans[0] = s[iOffset+1];
-						pPage->iTrans[1] = s[iOffset+3];
-						pPage->iTrans[2] = s[iOffset+5];
-						pPage->iTransLen = 3;
-					}
-                }
-				iMarker = 0;
-                break;
-            case 0x49444154: //'IDAT' image data block
-                while (iLen) {
-					int32_t chunk;
-                    if (iOffset >= iBytesRead) {
-                        // we ran out of data; get some more
-						if (d_stream.avail_in) {
-							iOffset -= d_stream.avail_in;
-							iLen += d_stream.avail_in;
-						}
-						more = 1;
-						break;
-                    }
-					chunk = iBytesRead - iOffset;
-					if (chunk > iLen) chunk = iLen;
-                    d_stream.next_in  = &pPage->ucFileBuf[iOffset];
-                    d_stream.avail_in = chunk;
-					
-                    iLen -= chunk;
-                    iOffset += chunk;
-                    err = 0;
-                    while (err == Z_OK) {
-                        if (d_stream.avail_out == 0) { // reset for next line
-                            d_stream.avail_out = pPage->iPitch+1; /* +1 for the filter mode */
-                            d_stream.next_out = pCurr;
-						} // otherwise it is a continuation of an unfinished line
-                        err = inflate(&d_stream, Z_NO_FLUSH, iOptions & PNG_CHECK_CRC);
-                        if ((err == Z_OK || err == Z_STREAM_END) && d_stream.avail_out == 0) {// successfully decoded line
-							uint8_t *tmp;
-							PNGDRAW pngd;					
-                            DeFilter(pCurr, pPrev, pPage->iWidth, pPage->iPitch);
-							pngd.User = User;
-							pngd.iPitch = pPage->iPitch;
-							pngd.iWidth = pPage->iWidth;
-							pngd.iPaletteCnt = pPage->iPaletteCnt;
-							pngd.pPalette = pPage->ucPalette;
-							pngd.pPixels = pCurr+1;
-							pngd.iPixelType = pPage->ucPixelType;
-							pngd.iHasAlpha = pPage->iHasAlpha;
-							pngd.iBpp = pPage->ucBpp;
-							pngd.iPaletteCnt = pPage->iPaletteCnt;
-							pngd.iBackground = pPage->iBackground;
-							pngd.iTransLen = pPage->iTransLen;
-							if (pngd.iTransLen)
-								memcpy(pngd.iTrans, pPage->iTrans, pngd.iTransLen);
-							
-							pngd.y = y;
-							(*pPage->pfnDraw)(&pngd);
-                            y++;
-							// swap current and previous lines
-							tmp = pCurr; pCurr = pPrev; pPrev = tmp;
-                        }
+	if (pR->iBatched) {
+		PNGDrawLines(pPage, pPage->pDrawRows, pR->pBatchBGR, pR->iBatchY, pR->iBatched, 0);
+		pR->iBatched = 0;
+	}
+} /* PNGDrawRows() */
+
+//
+// Defilter line y into the next row of pDrawRows (its BGR pixels into the
+// next line of pBGRLine), drawing them all once they are iDrawRows;
+// returns where it went, the next line's previous one
+//
+static uint8_t *PNGBatchLine(PNGIMAGE *pPage, uint8_t *pSrc, uint8_t *pPrev, int y)
+{
+	PNGRUN *pR = &pPage->run;
+	uint8_t *pCurr = &pPage->pDrawRows[pR->iBatched * (pPage->iPitch + 1)];
+	uint8_t *pBGR = NULL;
+
+	if (pCurr == pPrev) { // the batch got drawn early, with only this line in it
+		memcpy(pPage->uLine2, pPrev, pPage->iPitch + 1);
+		pPrev = pPage->uLine2;
+	}
+	if (pPage->pBGRLine)
+		pBGR = &pPage->pBGRLine[pR->iBatched * pPage->iWidth * 3];
+	pBGR = PNGDeFilterLine(pPage, pCurr, pSrc, pPrev, pPage->iPitch, pBGR);
+	if (*pCurr >= PNG_FILTER_COUNT) // a bad filter byte, it doesn't get drawn
+		return pPrev;
+	if (pR->iBatched++ == 0) {
+		pR->iBatchY = y;
+		pR->pBatchBGR = pBGR;
+	}
+	if (pR->iBatched == pPage->iDrawRows)
+		PNGDrawRows(pPage);
+	return pCurr;
+} /* PNGBatchLine() */
+
+//
+// Whether a decode's lines can go through pDrawRows: not Adam7 passes, not
+// APNG frames
+//
+static int PNGDrawBatch(PNGIMAGE *pPage, int iOptions)
+{
+	return pPage->pDrawRows != NULL && pPage->iDrawRows >= 2 && !pPage->iInterlaced && !(iOptions & PNG_ANIMATE);
+} /* PNGDrawBatch() */
+
+//
+// PNGInit
+// Parse the PNG file header and confirm that it's a valid file
+//
+// returns 0 for success, nonzero for failure
+//
+int PNG_init(PNGIMAGE *pPNG)
+{
+    return PNGParseInfo(pPNG); // gather info for image
+} /* PNG_init() */
+
+//
+// PNG_openRAM
+// Use a PNG file that is all in memory (iDataSize bytes at pData) instead
+// of the read/seek callbacks, then parse its header like PNG_init().
+// PNG_decode() takes the chunks and inflates the image data straight
+// from pData, which has to stay put until it is done.
+//
+// returns 0 for success, nonzero for failure
+//
+int PNG_openRAM(PNGIMAGE *pPNG, uint8_t *pData, int32_t iDataSize)
+{
+    if (pData == NULL || iDataSize <= 0) {
+        pPNG->iError = PNG_INVALID_PARAMETER;
+        return pPNG->iError;
+    }
+    pPNG->pfnRead = NULL;
+    pPNG->pfnSeek = NULL;
+    pPNG->PNGFile.pData = pData;
+    pPNG->PNGFile.iSize = iDataSize;
+    pPNG->PNGFile.iPos = 0;
+    return PNGParseInfo(pPNG);
+} /* PNG_openRAM() */
+
+//
+// PNG_probe
+// Walk the chunk list once PNG_init() (or PNG_openRAM()) has parsed the
+// header, seeking over the chunk data: fills in the chunk index and the
+// IDAT count/size, and parses PLTE, tRNS, bKGD and acTL, without inflating
+// anything. The file has to be seekable (or in memory), PNG_decode()
+// starts over from the first chunk anyway.
+//
+// returns 0 for success, nonzero for failure
+//
+int PNG_probe(PNGIMAGE *pPage)
+{
+    uint8_t *s;
+    off_t iPos = 8; // skip PNG file signature
+    int32_t iLen, iRead;
+    uint32_t iMarker;
+
+    pPage->iChunkCount = pPage->iIdatCount = 0;
+    pPage->iIdatSize = 0;
+    if (pPage->PNGFile.pData == NULL && pPage->pfnSeek == NULL) { // a stream can't be gone back to
+        pPage->iError = PNG_UNSUPPORTED_FEATURE;
+        return pPage->iError;
+    }
+    pPage->iError = PNG_SUCCESS;
+    for (;;) {
+        // chunk length and type
+        if (pPage->PNGFile.pData) {
+            iRead = (int32_t)(pPage->PNGFile.iSize - iPos);
+            if (iRead > 8) iRead = 8;
+            s = &pPage->PNGFile.pData[iPos];
+        } else {
+            s = pPage->ucFileBuf;
+            iRead = PNGReadAt(pPage, iPos, s, 8);
+        }
+        if (iRead == 0) // the file ends without an IEND, let that pass like PNG_decode() does
+            break;
+        if (iRead < 8) {
+            pPage->iError = (iRead < 0) ? PNG_IO_ERROR : PNG_DECODE_ERROR;
+            break;
+        }
+        iLen = MOTOLONG(s);
+        iMarker = MOTOLONG(&s[4]);
+        if (iLen < 0 || (pPage->PNGFile.iSize > 0 && iPos + 12 + iLen > pPage->PNGFile.iSize)) {
+            pPage->iError = PNG_DECODE_ERROR;
+            break;
+        }
+        if (pPage->iChunkCount < PNG_MAX_CHUNKS) {
+            pPage->chunks[pPage->iChunkCount].iType = iMarker;
+            pPage->chunks[pPage->iChunkCount].iOffset = iPos;
+            pPage->chunks[pPage->iChunkCount].iLen = iLen;
+        }
+        pPage->iChunkCount++;
+        switch (iMarker) {
+            case 0x49444154: //'IDAT' image data block
+                pPage->iIdatCount++;
+                pPage->iIdatSize += iLen;
+                break;
+            case 0x504c5445: //'PLTE' palette colors
+            case 0x74524e53: //'tRNS' transparency info
+            case 0x624b4744: //'bKGD' background color
+            case 0x6163544c: //'acTL' animation control
+                if (iLen > PNG_FILE_BUF_SIZE) {
+                    pPage->iError = PNG_DECODE_ERROR;
+                    break;
+                }
+                if (pPage->PNGFile.pData) {
+                    s += 8;
+                } else if (PNGReadAt(pPage, iPos + 8, s, iLen) != iLen) {
+                    pPage->iError = PNG_DECODE_ERROR;
+                    break;
+                }
+                PNGParseChunk(pPage, iMarker, s, iLen);
+                break;
+        }
+        if (pPage->iError || iMarker == 0x49454e44) //'IEND'
+            break;
+        iPos += 12 + iLen; // header + data + CRC
+    }
+    return pPage->iError;
+} /* PNG_probe() */
+
+//
+// Work out how many lines fit in a strip of iBudget bytes
+// (at least 1, at most the image height)
+//
+int PNG_getStripRows(PNGIMAGE *pPNG, int32_t iBudget)
+{
+	int32_t iRows = iBudget / (pPNG->iPitch + 1);
+#ifndef LINUX
+	/* avail_out is 16-bit here */
+	if (iRows * (pPNG->iPitch + 1) > 65534L - PNG_STRIP_PAD)
+		iRows = (65534L - PNG_STRIP_PAD) / (pPNG->iPitch + 1);
+#endif
+	if (iRows > pPNG->iHeight)
+		iRows = pPNG->iHeight;
+	if (iRows < 1)
+		iRows = 1;
+	return (int)iRows;
+} /* PNG_getStripRows() */
+
+//
+// Size of the pDeinterlace buffer an interlaced image needs
+// (0 if it isn't, or if that doesn't fit in an int32_t), with or
+// without PNG_PROGRESSIVE in iOptions
+//
+int32_t PNG_getDeinterlaceSize(PNGIMAGE *pPNG, int iOptions)
+{
+	int32_t iRows;
+
+	if (!pPNG->iInterlaced)
+		return 0;
+	if (iOptions & PNG_PROGRESSIVE) // all the lines, to draw them after every pass
+		iRows = pPNG->iHeight;
+	else // the even lines, the last pass brings the odd ones whole
+		iRows = (pPNG->iHeight + 1) / 2;
+	if (iRows < 0 || pPNG->iPitch < 0 || iRows > 0x7fffffffL / (pPNG->iPitch + 1))
+		return 0;
+	return iRows * (pPNG->iPitch + 1);
+} /* PNG_getDeinterlaceSize() */
+
+//
+// Size of the pCanvas buffer PNG_ANIMATE needs: the canvas as 8-bit RGBA,
+// twice (0 if that doesn't fit in an int32_t)
+//
+int32_t PNG_getCanvasSize(PNGIMAGE *pPNG)
+{
+	if (pPNG->iWidth <= 0 || pPNG->iHeight <= 0 || pPNG->iWidth > 0x0fffffffL / pPNG->iHeight)
+		return 0;
+	return pPNG->iWidth * pPNG->iHeight * 8;
+} /* PNG_getCanvasSize() */
+
+
+
+//
+// Get ready to walk the chunks from the one after the signature on:
+// returns the buffer to use, and sets the file position of its end and
+// how much of it is filled. NULL if a stream can't be gone back to that.
+//
+static uint8_t *PNGStartChunks(PNGIMAGE *pPage, off_t *pFileOffset, int32_t *pBytesRead, int32_t *pOffset)
+{
+	if (pPage->PNGFile.pData) {
+		// the whole file is in memory, use it as one big buffer that
+		// never needs a refill, IDATs get inflated straight from it
+		*pFileOffset = pPage->PNGFile.iSize;
+		*pBytesRead = (int32_t)pPage->PNGFile.iSize;
+		*pOffset = 8; // skip PNG file signature
+		return pPage->PNGFile.pData;
+	}
+	if (pPage->pfnSeek == NULL) {
+		// a stream, carry on from what PNG_init() read
+		if (pPage->PNGFile.iPos != PNG_INFO_SIZE)
+			return NULL;
+		memmove(pPage->pFileBuf, &pPage->ucFileBuf[8], PNG_INFO_SIZE - 8);
+		*pFileOffset = PNG_INFO_SIZE;
+		*pBytesRead = PNG_INFO_SIZE - 8;
+		*pOffset = 0;
+		return pPage->pFileBuf;
+	}
+	*pFileOffset = 8; // skip PNG file signature
+	*pBytesRead = *pOffset = 0; // nothing read yet
+	return pPage->pFileBuf;
+} /* PNGStartChunks() */
+
+#ifdef PNG_HAVE_INFBACK
+//
+// State of a decode driven by inflateBack(), handed to its callbacks
+//
+typedef struct png_back_tag
+{
+	PNGIMAGE *pPage;
+	long User;
+	int iOptions;
+	off_t iFileOffset; // file position of s[iBytesRead]
+	int32_t iBytesRead, iOffset; // data in s, and our position in it
+	int32_t iLen; // bytes left in the current chunk
+	int y;
+	int32_t iHave; // bytes of the current line gathered in pCurr
+	uint8_t *pCurr, *pPrev;
+	uLong ulAdler;
+	uLong ulCrc; // CRC of the current chunk so far (PNG_CHECK_CHUNK_CRC)
+	uint8_t *s; // pFileBuf, or the file itself when it is in memory
+} PNGBACK;
+
+//
+// Make sure there are at least iNeed bytes in s from iOffset on
+// returns 0 for success, nonzero for failure (iError is set)
+//
+static int PNGBackFill(PNGBACK *pB, int32_t iNeed)
+{
+	PNGIMAGE *pPage = pB->pPage;
+	uint8_t *s = pB->s;
+	int32_t left = pB->iBytesRead - pB->iOffset;
+	int32_t iRead;
+
+	if (left >= iNeed)
+		return 0;
+	if (pPage->PNGFile.pData) { // all of the file is there, it is too short
+		pPage->iError = PNG_DECODE_ERROR;
+		return 1;
+	}
+	if (left > 0) {
+		memmove(s, s+pB->iOffset, left);
+	} else {
+		/* skipping past what we have buffered */
+		pB->iFileOffset -= left;
+		left = 0;
+	}
+	iRead = PNGReadAt(pPage, pB->iFileOffset, s+left, pPage->iFileBufSize - left);
+	if (iRead < 0) {
+		pPage->iError = PNG_IO_ERROR;
+		return 1;
+	}
+	pB->iFileOffset += iRead;
+	pB->iBytesRead = left + iRead;
+	pB->iOffset = 0;
+	if (pB->iBytesRead < iNeed) { // file ended early
+		pPage->iError = PNG_DECODE_ERROR;
+		return 1;
+	}
+	return 0;
+} /* PNGBackFill() */
+
+//
+// Read the next chunk header, returns the chunk type (0 on failure)
+//
+static uint32_t PNGBackChunk(PNGBACK *pB)
+{
+	PNGIMAGE *pPage = pB->pPage;
+	uint8_t *s = pB->s;
+
+	if (PNGBackFill(pB, 8))
+		return 0;
+	pB->iLen = MOTOLONG(&s[pB->iOffset]);
+	if (pB->iLen < 0 || (pPage->PNGFile.iSize > 0 &&
+		pB->iLen + (pB->iFileOffset - pB->iBytesRead) > pPage->PNGFile.iSize)) {
+		pPage->iError = PNG_DECODE_ERROR;
+		return 0;
+	}
+	pB->iOffset += 8;
+	if (pB->iOptions & PNG_CHECK_CHUNK_CRC)
+		pB->ulCrc = crc32(0L, &s[pB->iOffset-4], 4);
+	return MOTOLONG(&s[pB->iOffset-4]);
+} /* PNGBackChunk() */
+
+//
+// Step over the CRC at the end of the current chunk's data,
+// checking it against ulCrc if asked to
+// returns 0 for success, nonzero for failure (iError is set)
+//
+static int PNGBackCrc(PNGBACK *pB)
+{
+	if (pB->iOptions & PNG_CHECK_CHUNK_CRC) {
+		if (PNGBackFill(pB, 4))
+			return 1;
+		if (MOTOLONG(&pB->s[pB->iOffset]) != (uint32_t)pB->ulCrc) {
+			pB->pPage->iError = PNG_DECODE_ERROR;
+			return 1;
+		}
+	}
+	pB->iOffset += 4;
+	return 0;
+} /* PNGBackCrc() */
+
+//
+// inflateBack() input callback: hands out the IDAT data chunk by chunk
+//
+static unsigned PNGBackIn(void FAR *desc, z_const unsigned char FAR * FAR *buf)
+{
+	PNGBACK *pB = (PNGBACK *)desc;
+	int32_t n;
+
+	while (pB->iLen == 0) { // move on to the next IDAT
+		if (PNGBackCrc(pB))
+			return 0;
+		if (PNGBackChunk(pB) != 0x49444154)
+			return 0;
+	}
+	if (PNGBackFill(pB, 1))
+		return 0;
+	n = pB->iBytesRead - pB->iOffset;
+	if (n > pB->iLen) n = pB->iLen;
+	*buf = &pB->s[pB->iOffset];
+	if (pB->iOptions & PNG_CHECK_CHUNK_CRC)
+		pB->ulCrc = crc32(pB->ulCrc, *buf, (uInt)n);
+	pB->iOffset += n;
+	pB->iLen -= n;
+	return (unsigned)n;
+} /* PNGBackIn() */
+
+//
+// inflateBack() output callback: defilters and draws the lines
+// as they come out of the window
+//
+static int PNGBackOut(void FAR *desc, unsigned char FAR *buf, unsigned len)
+{
+	PNGBACK *pB = (PNGBACK *)desc;
+	PNGIMAGE *pPage = pB->pPage;
+	int32_t iRowLen = pPage->iPitch + 1;
+
+	if (pB->iOptions & PNG_CHECK_CRC)
+		pB->ulAdler = adler32(pB->ulAdler, buf, len);
+	while (len && pB->y < pPage->iHeight) {
+		uint8_t *pSrc, *tmp, *pBGR;
+		if (pB->iHave == 0 && (int32_t)len >= iRowLen) {
+			// a whole line in the window, defilter it from there
+			pSrc = buf;
+			buf += iRowLen;
+			len -= (unsigned)iRowLen;
+		} else {
+			unsigned n = (unsigned)(iRowLen - pB->iHave);
+			if (n > len) n = len;
+			memcpy(pB->pCurr + pB->iHave, buf, n);
+			buf += n;
+			len -= n;
+			pB->iHave += n;
+			if (pB->iHave < iRowLen)
+				break;
+			pSrc = pB->pCurr;
+			pB->iHave = 0;
+		}
+		if (pPage->run.iDrawBatch) { // (pCurr only gathers the lines then)
+			pB->pPrev = PNGBatchLine(pPage, pSrc, pB->pPrev, pB->y);
+			if (pPage->iError)
+				return 1; // stops inflateBack()
+		} else {
+			pBGR = PNGDeFilterLine(pPage, pB->pCurr, pSrc, pB->pPrev, pPage->iPitch, pPage->pBGRLine);
+			if (pPage->iError)
+				return 1;
+			PNGDrawLines(pPage, pB->pCurr, pBGR, pB->y, 1, 0);
+			// swap current and previous lines
+			tmp = pB->pCurr; pB->pCurr = pB->pPrev; pB->pPrev = tmp;
+		}
+		pB->y++;
+	}
+	return 0;
+} /* PNGBackOut() */
+
+//
+// Decode the PNG file with inflateBack() doing the driving
+//
+static int PNGDecodeBack(PNGIMAGE *pPage, long User, int iOptions)
+{
+	PNGBACK back;
+	z_stream d_stream;
+	struct inflate_state *state;
+	z_const unsigned char FAR *next = Z_NULL;
+	unsigned have = 0;
+	uint8_t hdr[4];
+	uint32_t iMarker;
+	int err, i;
+
+	memset(&back, 0, sizeof(back));
+	back.pPage = pPage;
+	back.User = User;
+	back.iOptions = iOptions;
+	back.pCurr = pPage->uLine1;
+	back.pPrev = pPage->uLine2;
+	memset(back.pPrev, 0, pPage->iPitch+1); // the line above the first one is all zeroes
+	// the draw state lives in run, as for PNG_decode()
+	memset(&pPage->run, 0, sizeof(PNGRUN));
+	pPage->run.User = User;
+	pPage->run.iDrawBatch = PNGDrawBatch(pPage, iOptions);
+	back.s = PNGStartChunks(pPage, &back.iFileOffset, &back.iBytesRead, &back.iOffset);
+	if (back.s == NULL) {
+		pPage->iError = PNG_IO_ERROR;
+		return pPage->iError;
+	}
+	back.ulAdler = adler32(0L, Z_NULL, 0);
+
+	// Walk the chunks up to the image data
+	for (;;) {
+		iMarker = PNGBackChunk(&back);
+		if (pPage->iError)
+			return pPage->iError;
+		if (iMarker == 0x49444154) //'IDAT'
+			break;
+		switch (iMarker) {
+			case 0x504c5445: //'PLTE' palette colors
+			case 0x74524e53: //'tRNS' transparency info
+			case 0x624b4744: //'bKGD' background color
+				if (back.iLen > pPage->iFileBufSize) {
+					pPage->iError = PNG_DECODE_ERROR;
+					return pPage->iError;
+				}
+				if (PNGBackFill(&back, back.iLen))
+					return pPage->iError;
+				if (iOptions & PNG_CHECK_CHUNK_CRC)
+					back.ulCrc = crc32(back.ulCrc, &back.s[back.iOffset], (uInt)back.iLen);
+				PNGParseChunk(pPage, iMarker, &back.s[back.iOffset], back.iLen);
+				if (pPage->iError)
+					return pPage->iError;
+				back.iOffset += back.iLen;
+				if (PNGBackCrc(&back))
+					return pPage->iError;
+				continue;
+		}
+		back.iOffset += back.iLen + 4; // skip data + CRC
+	}
+
+	// inflateBack() does raw deflate, so deal with the zlib header here
+	for (i = 0; i < 2; i++) {
+		if (!have)
+			have = PNGBackIn(&back, &next);
+		if (!have) {
+			pPage->iError = PNG_DECODE_ERROR;
+			return pPage->iError;
+		}
+		hdr[i] = *next++;
+		have--;
+	}
+	if ((((hdr[0] << 8) | hdr[1]) % 31) || ((hdr[0] & 0x0f) != Z_DEFLATED) ||
+		((hdr[0] >> 4) > 7) || (hdr[1] & 0x20)) { // no preset dictionaries in PNG
+		pPage->iError = PNG_DECODE_ERROR;
+		return pPage->iError;
+	}
+
+	d_stream.zalloc = (alloc_func)0;
+	d_stream.zfree = (free_func)0;
+	d_stream.opaque = (voidpf)0;
+	// same preallocated state as PNG_decode(), the window is inflateBack()'s output buffer
+	state = (struct inflate_state FAR *)pPage->ucZLIB;
+	d_stream.state = (struct internal_state FAR *)state;
+	err = inflateBackInit(&d_stream, MAX_WBITS, &pPage->ucZLIB[sizeof(struct inflate_state)]);
+	if (err != Z_OK) {
+		pPage->iError = PNG_DECODE_ERROR;
+		return pPage->iError;
+	}
+	d_stream.next_in = (z_const unsigned char FAR *)next;
+	d_stream.avail_in = have;
+	err = inflateBack(&d_stream, PNGBackIn, &back, PNGBackOut, &back);
+	if (err == Z_STREAM_END && (iOptions & PNG_CHECK_CRC)) {
+		// check the Adler-32 trailer
+		next = d_stream.next_in;
+		have = d_stream.avail_in;
+		for (i = 0; i < 4; i++) {
+			if (!have)
+				have = PNGBackIn(&back, &next);
+			if (!have) {
+				err = Z_DATA_ERROR;
+				break;
+			}
+			hdr[i] = *next++;
+			have--;
+		}
+		if (err == Z_STREAM_END && MOTOLONG(hdr) != back.ulAdler)
+			err = Z_DATA_ERROR;
+	}
+	if (err == Z_STREAM_END && (iOptions & PNG_CHECK_CHUNK_CRC)) {
+		// the rest of the last IDAT goes through PNGBackIn() for its CRC
+		while (back.iLen && PNGBackIn(&back, &next))
+			;
+		if (back.iLen || PNGBackCrc(&back))
+			err = Z_DATA_ERROR;
+	}
+	if (!pPage->iError && (err != Z_STREAM_END || back.y < pPage->iHeight))
+		pPage->iError = PNG_DECODE_ERROR;
+	PNGDrawRows(pPage);
+	inflateBackEnd(&d_stream);
+	return pPage->iError;
+} /* PNGDecodeBack() */
+#endif // PNG_HAVE_INFBACK
+
+// PNG_decodeFeed() stages (PNGRUN.iFeed)
+#define PNG_FEED_INFO 1 // gathering the signature and IHDR
+#define PNG_FEED_CHUNKS 2 // decoding
+#define PNG_FEED_DONE 3
+
+//
+// Adam7 passes: first column and line, column and line steps, and the
+// size of the block a pixel stands for in the coarse PNG_PROGRESSIVE image
+//
+static const uint8_t ucAdam7[7][6] = {
+	{0, 0, 8, 8, 8, 8},
+	{4, 0, 8, 8, 4, 8},
+	{0, 4, 4, 8, 4, 4},
+	{2, 0, 4, 4, 2, 4},
+	{0, 2, 2, 4, 2, 2},
+	{1, 0, 2, 2, 1, 2},
+	{0, 1, 1, 2, 1, 1}
+};
+
+//
+// Bits per pixel, all of its samples
+//
+static int PNGPixelBits(PNGIMAGE *pPage)
+{
+	switch (pPage->ucPixelType) {
+		case PNG_PIXEL_TRUECOLOR:
+			return 3 * pPage->ucBpp;
+		case PNG_PIXEL_GRAY_ALPHA:
+			return 2 * pPage->ucBpp;
+		case PNG_PIXEL_TRUECOLOR_ALPHA:
+			return 4 * pPage->ucBpp;
+		default: // grayscale, indexed
+			return pPage->ucBpp;
+	}
+} /* PNGPixelBits() */
+
+//
+// Get ready for Adam7 pass iPass, or the first one after it that has
+// any pixels (empty passes aren't in the data at all)
+// returns 0 when there are no passes left
+//
+static int PNGAdam7Pass(PNGIMAGE *pPage, int iPass)
+{
+	PNGRUN *pR = &pPage->run;
+	const uint8_t *a;
+
+	for (; iPass < 7; iPass++) {
+		a = ucAdam7[iPass];
+		if (pPage->iWidth <= a[0] || pPage->iHeight <= a[1])
+			continue;
+		pR->iPass = iPass;
+		pR->iPassWidth = (pPage->iWidth - a[0] + a[2] - 1) / a[2];
+		pR->iPassRows = (pPage->iHeight - a[1] + a[3] - 1) / a[3];
+		pR->iPassRow = 0;
+		pR->iRowLen = (pR->iPassWidth * PNGPixelBits(pPage) + 7) / 8 + 1;
+		pR->iOutSize = (uInt)pR->iRowLen;
+		return 1;
+	}
+	pR->iPass = 7;
+	return 0;
+} /* PNGAdam7Pass() */
+
+//
+// Put the iWidth pixels of a pass line (pSrc) in their places in the image
+// line pDst: column a[0] on, every a[2]th one, each repeated iRep times
+//
+static void PNGScatter(PNGIMAGE *pPage, uint8_t *pDst, uint8_t *pSrc, const uint8_t *a, int32_t iWidth, int iRep)
+{
+	int iBits = PNGPixelBits(pPage);
+	int32_t i, x, iBit;
+	int k, iShift;
+
+	if (iBits >= 8) {
+		int iBytes = iBits / 8;
+		for (i = 0, x = a[0]; i < iWidth; i++, x += a[2], pSrc += iBytes) {
+			for (k = 0; k < iRep && x + k < pPage->iWidth; k++)
+				memcpy(&pDst[(x + k) * iBytes], pSrc, iBytes);
+		}
+	} else { // 1, 2 or 4 bits, packed from the top bit down
+		uint8_t ucMask = (uint8_t)((1 << iBits) - 1);
+		for (i = 0, x = a[0]; i < iWidth; i++, x += a[2]) {
+			uint8_t v;
+			iBit = i * iBits;
+			v = (pSrc[iBit >> 3] >> (8 - iBits - (int)(iBit & 7))) & ucMask;
+			for (k = 0; k < iRep && x + k < pPage->iWidth; k++) {
+				iBit = (x + k) * iBits;
+				iShift = 8 - iBits - (int)(iBit & 7);
+				pDst[iBit >> 3] = (uint8_t)((pDst[iBit >> 3] & ~(ucMask << iShift)) | (v << iShift));
+			}
+		}
+	}
+} /* PNGScatter() */
+
+//
+// Put a defiltered line of the current APNG frame (pSrc, past its filter
+// byte) in the canvas, as line y of the frame's region
+//
+static void PNGBlendLine(PNGIMAGE *pPage, uint8_t *pSrc, int32_t y)
+{
+	PNGFRAME *pF = &pPage->run.frame;
+	uint8_t *d = &pPage->pCanvas[((pF->iY + y) * pF->iWidth + pF->iX) * 4];
+	int iBits = PNGPixelBits(pPage);
+	int iBytes = iBits / 8; // 0 for 1, 2 and 4-bit pixels
+	int iStep = (pPage->ucBpp > 8) ? 2 : 1; // 16-bit samples: the high byte will do
+	int32_t x;
+	unsigned v;
+	uint8_t *p, r, g, b, a;
+
+	for (x = 0; x < pF->iFrameWidth; x++, d += 4) {
+		p = &pSrc[x * iBytes];
+		a = 255;
+		switch (pPage->ucPixelType) {
+			case PNG_PIXEL_GRAYSCALE:
+			case PNG_PIXEL_INDEXED:
+				if (iBits < 8)
+					v = (pSrc[(x * iBits) >> 3] >> (8 - iBits - (int)((x * iBits) & 7))) & ((1 << iBits) - 1);
+				else
+					v = p[0];
+				if (pPage->ucPixelType == PNG_PIXEL_INDEXED) {
+					r = pPage->ucPalette[v * 3];
+					g = pPage->ucPalette[v * 3 + 1];
+					b = pPage->ucPalette[v * 3 + 2];
+					a = pPage->ucPalette[768 + v];
+					break;
+				}
+				if (iBits < 8) {
+					if (pPage->iTransLen == 1 && v == pPage->iTrans[0])
+						a = 0;
+					v = v * 255 / ((1 << iBits) - 1);
+				} else if (pPage->iTransLen == iBytes && memcmp(p, pPage->iTrans, iBytes) == 0) {
+					a = 0;
+				}
+				r = g = b = (uint8_t)v;
+				break;
+			case PNG_PIXEL_TRUECOLOR:
+				if (pPage->iTransLen == iBytes && memcmp(p, pPage->iTrans, iBytes) == 0)
+					a = 0;
+				r = p[0];
+				g = p[iStep];
+				b = p[2 * iStep];
+				break;
+			case PNG_PIXEL_GRAY_ALPHA:
+				r = g = b = p[0];
+				a = p[iStep];
+				break;
+			default: // truecolor + alpha
+				r = p[0];
+				g = p[iStep];
+				b = p[2 * iStep];
+				a = p[3 * iStep];
+				break;
+		}
+		if (a == 255 || pF->ucBlend == PNG_BLEND_SOURCE) {
+			d[0] = r; d[1] = g; d[2] = b; d[3] = a;
+		} else if (a) { // PNG_BLEND_OVER, the APNG spec's formula in 8 bits
+			uint32_t u = (uint32_t)a * 255;
+			uint32_t w = (uint32_t)d[3] * (255 - a);
+			uint32_t t = u + w;
+			d[0] = (uint8_t)((r * u + d[0] * w) / t);
+			d[1] = (uint8_t)((g * u + d[1] * w) / t);
+			d[2] = (uint8_t)((b * u + d[2] * w) / t);
+			d[3] = (uint8_t)(t / 255);
+		}
+	}
+} /* PNGBlendLine() */
+
+//
+// Hand a finished image line on: into the canvas when it is from an
+// APNG frame, to the draw callback otherwise
+//
+static void PNGPutLine(PNGIMAGE *pPage, uint8_t *pLine, uint8_t *pBGR, int y, int iPass)
+{
+	PNGRUN *pR = &pPage->run;
+
+	if (pR->iFrameData)
+		PNGBlendLine(pPage, pLine + 1, y);
+	else
+		PNGDrawLines(pPage, pLine, pBGR, y, 1, iPass);
+} /* PNGPutLine() */
+
+//
+// Put a defiltered line of the current Adam7 pass in its place, draw the
+// image lines that are done, and move on to the next line (or pass)
+//
+static void PNGAdam7Line(PNGIMAGE *pPage, uint8_t *pLine)
+{
+	PNGRUN *pR = &pPage->run;
+	const uint8_t *a = ucAdam7[pR->iPass];
+	int32_t iLineLen = pPage->iPitch + 1;
+	int32_t y = a[1] + pR->iPassRow * a[3]; // image line
+	uint8_t *pDst;
+	int i;
+
+	if (pR->iOptions & PNG_PROGRESSIVE) {
+		// fill the blocks the pixels stand for, later passes write over them
+		pDst = &pPage->pDeinterlace[y * iLineLen];
+		PNGScatter(pPage, pDst + 1, pLine + 1, a, pR->iPassWidth, a[4]);
+		for (i = 1; i < a[5] && y + i < pPage->iHeight; i++)
+			memcpy(pDst + i * iLineLen, pDst, iLineLen);
+	} else if (pR->iPass < 6) { // put the even lines together
+		PNGScatter(pPage, &pPage->pDeinterlace[(y / 2) * iLineLen + 1], pLine + 1, a, pR->iPassWidth, 1);
+	} else { // the last pass has whole odd lines, and the even line above is done
+		PNGPutLine(pPage, &pPage->pDeinterlace[(y / 2) * iLineLen], NULL, y - 1, 0);
+		PNGPutLine(pPage, pLine, NULL, y, 0);
+		pR->iDrawY = y + 1;
+	}
+	if (++pR->iPassRow < pR->iPassRows)
+		return;
+	// end of the pass
+	if (pR->iOptions & PNG_PROGRESSIVE) {
+		for (y = 0; y < pPage->iHeight; y++)
+			PNGPutLine(pPage, &pPage->pDeinterlace[y * iLineLen], NULL, y, pR->iPass + 1);
+	}
+	if (!PNGAdam7Pass(pPage, pR->iPass + 1) && !(pR->iOptions & PNG_PROGRESSIVE)) {
+		// the last even line has no odd one after it (a single line has no last pass at all)
+		for (y = pR->iDrawY; y < pPage->iHeight; y++)
+			PNGPutLine(pPage, &pPage->pDeinterlace[(y / 2) * iLineLen], NULL, y, 0);
+	}
+	memset(pLine, 0, iLineLen); // the line above the first one of a pass is all zeroes
+} /* PNGAdam7Line() */
+
+//
+// Make the image size that of the APNG frame being decoded (or the
+// canvas' again), the line buffers and Adam7 passes go by it
+//
+static void PNGFrameSize(PNGIMAGE *pPage, int32_t iWidth, int32_t iHeight)
+{
+	pPage->iWidth = iWidth;
+	pPage->iHeight = iHeight;
+	pPage->iPitch = (iWidth * PNGPixelBits(pPage) + 7) / 8;
+} /* PNGFrameSize() */
+
+//
+// Set up the line buffers for the image data of an iWidth x iHeight
+// image (or APNG frame), inflating into the start of pOut
+//
+static void PNGRunLines(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+
+	pR->iRowLen = pPage->iPitch + 1;
+	pR->iRows = pPage->iHeight;
+	if ((pPage->pStrip) && (pPage->iStripRows > 0) && !pPage->iInterlaced) {
+		pR->pOut = pPage->pStrip;
+		pR->iOutSize = (uInt)(pR->iRowLen * pPage->iStripRows);
+	} else {
+		pR->pOut = pPage->uLine1;
+		pR->iOutSize = (uInt)pR->iRowLen;
+	}
+	pR->pRow = pR->pOut;
+	pR->pPrev = pPage->uLine2;
+	memset(pR->pPrev, 0, pR->iRowLen); // the line above the first one is all zeroes
+	if (pPage->iInterlaced) {
+		// the passes go line by line, the line length changes from one to the next
+		for (pR->iRows = 0, pR->iPass = 0; PNGAdam7Pass(pPage, pR->iPass); pR->iPass++)
+			pR->iRows += pR->iPassRows;
+		PNGAdam7Pass(pPage, 0);
+		pR->iDrawY = 0;
+		memset(pPage->pDeinterlace, 0, PNG_getDeinterlaceSize(pPage, pR->iOptions));
+	}
+	pR->d_stream.avail_out = 0;
+	pR->y = 0;
+} /* PNGRunLines() */
+
+//
+// The last line of an APNG frame is in the canvas: hand the frame over,
+// then dispose of it the way its fcTL says
+//
+static void PNGFrameDone(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+	PNGFRAME *pF = &pR->frame;
+	uint8_t *d = &pPage->pCanvas[(pF->iY * pF->iWidth + pF->iX) * 4];
+	uint8_t *pSave = &pPage->pCanvas[pF->iWidth * pF->iHeight * 4];
+	int32_t y, iLen = pF->iFrameWidth * 4;
+	int32_t bg = (int32_t)pPage->iBackground;
+
+	switch (pPage->ucPixelType) { // the background as 0xBBGGRR
+		case PNG_PIXEL_INDEXED:
+			if (bg >= 0 && bg < 256)
+				bg = pPage->ucPalette[bg * 3] | ((int32_t)pPage->ucPalette[bg * 3 + 1] << 8) |
+					((int32_t)pPage->ucPalette[bg * 3 + 2] << 16);
+			else
+				bg = 0x999999L;
+			break;
+		case PNG_PIXEL_GRAYSCALE:
+		case PNG_PIXEL_GRAY_ALPHA:
+			if (bg < 0)
+				bg = 0x99;
+			else if (pPage->ucBpp < 8)
+				bg = bg * 255 / ((1 << pPage->ucBpp) - 1);
+			bg = (bg & 0xff) * 0x010101L;
+			break;
+	}
+	pF->iBackground = bg;
+	(*pPage->pfnFrame)(pF);
+
+	switch (pF->ucDispose) {
+		case PNG_DISPOSE_BACKGROUND:
+			for (y = 0; y < pF->iFrameHeight; y++, d += pF->iWidth * 4)
+				memset(d, 0, (size_t)iLen);
+			break;
+		case PNG_DISPOSE_PREVIOUS:
+			for (y = 0; y < pF->iFrameHeight; y++, d += pF->iWidth * 4, pSave += iLen)
+				memcpy(d, pSave, (size_t)iLen);
+			break;
+	}
+	pF->iFrame++;
+	pR->iFramesLeft--;
+} /* PNGFrameDone() */
+
+//
+// Start an APNG frame from its fcTL (iLen bytes at p): its region,
+// delay and ops, and a fresh zlib stream for its data
+// returns 0 for success, nonzero for failure (iError is set)
+//
+static int PNGFrameControl(PNGIMAGE *pPage, uint8_t *p, int32_t iLen)
+{
+	PNGRUN *pR = &pPage->run;
+	PNGFRAME *pF = &pR->frame;
+	uint32_t w, h, x, y;
+	uint8_t *d, *pSave;
+
+	if (iLen < 26 || MOTOLONG(p) != pR->iSeq || pR->iFramesLeft <= 0 ||
+		(pR->iFrameData && pR->y < pR->iRows)) { // (the frame before isn't done)
+		pPage->iError = PNG_DECODE_ERROR;
+		return pPage->iError;
+	}
+	pR->iSeq++;
+	w = MOTOLONG(&p[4]);
+	h = MOTOLONG(&p[8]);
+	x = MOTOLONG(&p[12]);
+	y = MOTOLONG(&p[16]);
+	if (w == 0 || h == 0 || w > (uint32_t)pF->iWidth || h > (uint32_t)pF->iHeight ||
+		x > pF->iWidth - w || y > pF->iHeight - h ||
+		p[24] > PNG_DISPOSE_PREVIOUS || p[25] > PNG_BLEND_OVER ||
+		(!pR->iIdatSeen && (x || y || w != (uint32_t)pF->iWidth || h != (uint32_t)pF->iHeight))) {
+		// (a frame in the IDATs has to be the whole image)
+		pPage->iError = PNG_DECODE_ERROR;
+		return pPage->iError;
+	}
+	pF->iX = (int32_t)x;
+	pF->iY = (int32_t)y;
+	pF->iFrameWidth = (int32_t)w;
+	pF->iFrameHeight = (int32_t)h;
+	pF->usDelayNum = (uint16_t)MOTOSHORT(&p[20]);
+	pF->usDelayDen = (uint16_t)MOTOSHORT(&p[22]);
+	pF->ucDispose = p[24];
+	pF->ucBlend = p[25];
+	if (pF->iFrame == 0 && pF->ucDispose == PNG_DISPOSE_PREVIOUS) // nothing to go back to
+		pF->ucDispose = PNG_DISPOSE_BACKGROUND;
+	if (pF->ucDispose == PNG_DISPOSE_PREVIOUS) { // keep what the frame draws over
+		d = &pPage->pCanvas[(pF->iY * pF->iWidth + pF->iX) * 4];
+		pSave = &pPage->pCanvas[pF->iWidth * pF->iHeight * 4];
+		for (y = 0; y < h; y++, d += pF->iWidth * 4, pSave += w * 4)
+			memcpy(pSave, d, (size_t)w * 4);
+	}
+	pR->iFrameData = pR->iIdatSeen ? 0x66644154 /*'fdAT'*/ : 0x49444154 /*'IDAT'*/;
+
+	// the frame's lines, and its own zlib stream in the same inflate state
+	PNGFrameSize(pPage, pF->iFrameWidth, pF->iFrameHeight);
+	PNGRunLines(pPage);
+	inflateReset(&pR->d_stream);
+	if (pR->pOut == pPage->pStrip)
+		inflateOutputSlack(&pR->d_stream, PNG_STRIP_PAD);
+	pR->iStreamEnd = 0;
+	pR->iCrcMore = pR->iOptions & PNG_CHECK_CHUNK_CRC;
+	return PNG_SUCCESS;
+} /* PNGFrameControl() */
+
+//
+// An IDAT came in with PNG_ANIMATE: returns 1 if it is frame data, 0 if
+// it is a default image that isn't part of the animation
+//
+static int PNGFrameIdat(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+	PNGFRAME *pF = &pR->frame;
+
+	if (pR->iFrameData == 0x49444154) { // the first frame (or more of it)
+		pR->iIdatSeen = 1;
+		return 1;
+	}
+	if (pR->iAnimated || pR->iIdatSeen) {
+		pR->iIdatSeen = 1;
+		return 0;
+	}
+	// not an APNG, the image is its one frame
+	pR->iIdatSeen = 1;
+	pR->iFrameData = 0x49444154;
+	pR->iFramesLeft = pF->iFrameCount = 1;
+	pF->iX = pF->iY = 0;
+	pF->iFrameWidth = pF->iWidth;
+	pF->iFrameHeight = pF->iHeight;
+	pF->ucDispose = PNG_DISPOSE_NONE;
+	pF->ucBlend = PNG_BLEND_SOURCE;
+	return 1;
+} /* PNGFrameIdat() */
+
+//
+// Check that the caller gave us what a decode needs, and settle on the file buffer
+// returns 0 for success, nonzero for failure (iError is set)
+//
+static int PNGCheckBuffers(PNGIMAGE *pPage, int iOptions)
+{
+    // we need the draw callback and the linebuffers
+    if ((pPage->pfnDraw == NULL && !(iOptions & PNG_ANIMATE))||(pPage->uLine1 == NULL)||(pPage->uLine2 == NULL)) {
+		pPage->iError = PNG_NO_BUFFER;
+		return pPage->iError;
+	}
+	// or the frame callback and the canvas to put the frames together in
+	if ((iOptions & PNG_ANIMATE) && (pPage->pfnFrame == NULL || pPage->pCanvas == NULL)) {
+		pPage->iError = PNG_NO_BUFFER;
+		return pPage->iError;
+	}
+	// and somewhere to put interlaced images together
+	if (pPage->iInterlaced && pPage->pDeinterlace == NULL) {
+		pPage->iError = PNG_NO_BUFFER;
+		return pPage->iError;
+	}
+	if (pPage->iInterlaced && PNG_getDeinterlaceSize(pPage, iOptions) <= 0) {
+		pPage->iError = PNG_TOO_BIG;
+		return pPage->iError;
+	}
+#ifdef PNG_HAVE_THREADS
+	// and the ring for the rows to go from one thread to the other in
+	if ((iOptions & PNG_THREADS) && (pPage->pRing == NULL || pPage->iRingRows < 2)) {
+		pPage->iError = PNG_NO_BUFFER;
+		return pPage->iError;
+	}
+#endif
+	// and a file buffer, ucFileBuf unless the caller gave us one
+	if (pPage->pFileBuf == NULL) {
+		pPage->pFileBuf = pPage->ucFileBuf;
+		pPage->iFileBufSize = PNG_FILE_BUF_SIZE;
+	} else if (pPage->iFileBufSize < PNG_FILE_BUF_SIZE) {
+		pPage->iError = PNG_INVALID_PARAMETER;
+		return pPage->iError;
+	}
+	return PNG_SUCCESS;
+} /* PNGCheckBuffers() */
+
+//
+// Set up the line buffers and inflate for a decode,
+// the caller then points pPage->run at the data
+//
+static void PNGRunStart(PNGIMAGE *pPage, long User, int iOptions)
+{
+	PNGRUN *pR = &pPage->run;
+    struct inflate_state *state;
+
+	memset(pR, 0, sizeof(PNGRUN));
+	if (iOptions & PNG_ANIMATE) // frames go into the canvas whole
+		iOptions &= ~PNG_PROGRESSIVE;
+	pR->User = User;
+	pR->iOptions = iOptions;
+	pR->iCrcMore = iOptions & PNG_CHECK_CHUNK_CRC;
+	pR->iDrawBatch = PNGDrawBatch(pPage, iOptions);
+	if (iOptions & PNG_ANIMATE) {
+		// frames get decoded until the last one is done, an image that
+		// isn't an APNG is one frame
+		pR->iFramesLeft = 1;
+		pR->frame.iWidth = pPage->iWidth;
+		pR->frame.iHeight = pPage->iHeight;
+		pR->frame.User = User;
+		pR->frame.pCanvas = pPage->pCanvas;
+		memset(pPage->pCanvas, 0, (size_t)(pPage->iWidth * pPage->iHeight * 4)); // transparent black
+	}
+
+    // buffers to maintain the current and previous lines
+	PNGRunLines(pPage);
+
+    // Inflate the compressed image data
+    // The allocation functions are disabled and zlib has been modified
+    // to not use malloc/free and instead the buffer is part of the PNG class
+    pR->d_stream.zalloc = (alloc_func)0;
+    pR->d_stream.zfree = (free_func)0;
+    pR->d_stream.opaque = (voidpf)0;
+    // Insert the memory pointer here to avoid having to use malloc() inside zlib
+    state = (struct inflate_state FAR *)pPage->ucZLIB;
+    pR->d_stream.state = (struct internal_state FAR *)state;
+    state->window = &pPage->ucZLIB[sizeof(struct inflate_state)]; // point to 32k dictionary buffer
+    inflateInit(&pR->d_stream);
+	if (pR->pOut == pPage->pStrip) // let match copies run into the padding
+		inflateOutputSlack(&pR->d_stream, PNG_STRIP_PAD);
+	if (pR->pOut == pPage->pStrip && pPage->iStripRows >= pPage->iHeight && !(iOptions & PNG_ANIMATE)) {
+		// the strip holds the whole image, so inflate can use it as its
+		// window instead of copying every line into state->window
+		pR->iWinOut = (inflateOutputWindow(&pR->d_stream, pR->pOut) == Z_OK);
+	}
+} /* PNGRunStart() */
+
+#ifdef PNG_HAVE_THREADS
+//
+// PNG_THREADS: sleep until *pCount is no longer iSeen (or the rows end),
+// and wake the other side after changing a count
+//
+static void PNGRingSleep(PNGRING *pRing, int32_t *pCount, int32_t iSeen)
+{
+	pthread_mutex_lock(&pRing->mutex);
+	__atomic_add_fetch(&pRing->iSleepers, 1, __ATOMIC_SEQ_CST);
+	while (__atomic_load_n(pCount, __ATOMIC_SEQ_CST) == iSeen && !__atomic_load_n(&pRing->iEnd, __ATOMIC_SEQ_CST))
+		pthread_cond_wait(&pRing->cond, &pRing->mutex);
+	__atomic_sub_fetch(&pRing->iSleepers, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&pRing->mutex);
+} /* PNGRingSleep() */
+
+static void PNGRingWake(PNGRING *pRing)
+{
+	// (a sleeper counts itself before it looks at the count, with the mutex
+	// held until it waits, so it either sees the new count or gets woken)
+	if (__atomic_load_n(&pRing->iSleepers, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&pRing->mutex);
+		pthread_cond_broadcast(&pRing->cond);
+		pthread_mutex_unlock(&pRing->mutex);
+	}
+} /* PNGRingWake() */
+
+//
+// The inflate thread's side: copy a filtered row in once there is room
+//
+static void PNGRingPut(PNGRING *pRing, const uint8_t *pRow)
+{
+	int32_t n = pRing->iPut, iDone;
+
+	while (n - (iDone = __atomic_load_n(&pRing->iDone, __ATOMIC_ACQUIRE)) + 1 >= pRing->iSlots)
+		PNGRingSleep(pRing, &pRing->iDone, iDone);
+	memcpy(&pRing->pRows[(n % pRing->iSlots) * pRing->iRowLen], pRow, (size_t)pRing->iRowLen);
+	__atomic_store_n(&pRing->iPut, n + 1, __ATOMIC_SEQ_CST);
+	PNGRingWake(pRing);
+} /* PNGRingPut() */
+
+//
+// The drawing side: the next row, NULL when there are no more
+//
+static uint8_t *PNGRingGet(PNGRING *pRing)
+{
+	int32_t n = pRing->iDone;
+
+	while (__atomic_load_n(&pRing->iPut, __ATOMIC_ACQUIRE) == n) {
+		if (__atomic_load_n(&pRing->iEnd, __ATOMIC_ACQUIRE)) {
+			// (a last row can have gone in just before the end)
+			if (__atomic_load_n(&pRing->iPut, __ATOMIC_ACQUIRE) == n)
+				return NULL;
+			break;
+		}
+		PNGRingSleep(pRing, &pRing->iPut, n);
+	}
+	return &pRing->pRows[(n % pRing->iSlots) * pRing->iRowLen];
+} /* PNGRingGet() */
+#endif // PNG_HAVE_THREADS
+
+//
+// Walk the chunks and inflate the image data, drawing lines as they
+// complete, until the image is done or the data in pR->s runs out:
+// then PNG_decode() reads more, PNG_decodeFeed() gets PNG_NEED_MORE
+// returns the error code
+//
+static int PNGRun(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+	z_streamp strm = &pR->d_stream;
+	uint8_t *s = pR->s;
+	uint8_t *pLine, *pBGR;
+	z_const Bytef *pIn; /* where inflate started taking input */
+	int err;
+	
+    while ((!pPage->iError)&&(pR->y < pR->iRows || pR->iCrcMore || pR->iFramesLeft)) { // continue until fully decoded
+		int32_t left = pR->iBytesRead - pR->iOffset;
+        if ((left < 8)||(pR->more)) { // need to read more data
+			//printf("left %d more %d Offset %d\n", left, more, iOffset);
+			if (pR->iFeed) // PNG_decodeFeed() brings it
+				return PNG_NEED_MORE;
+			if (pPage->PNGFile.pData) { // there is no more, the file is cut short
+				pPage->iError = PNG_DECODE_ERROR;
+				break;
+			}
+			if (left > 0) {
+				memmove(s, s+pR->iOffset, left);
+			} else {
+				/* This is the case where we skip some file data. (-= left which is negative -> adds to iFileOffset) */
+				pR->iFileOffset -= left;
+				left = 0;
+			}
+            pR->iBytesRead = PNGReadAt(pPage, pR->iFileOffset, s+left, pPage->iFileBufSize - left);
+			if (pR->iBytesRead <= 0) { // nothing more to be had, the file is cut short
+				pPage->iError = (pR->iBytesRead < 0) ? PNG_IO_ERROR : PNG_DECODE_ERROR;
+				break;
+			}
+            pR->iFileOffset += pR->iBytesRead;
+			pR->iBytesRead += left;
+            pR->iOffset = 0;
+			pR->more = 0;
+			/*
+			printf("iFO %ld BR %d\n", iFileOffset, iBytesRead);
+			printf("%02X %02X %02X %02X  %02X %02X %02X %02X  - %02X %02X %02X %02X  %02X %02X %02X %02X\n",
+				s[0x0], s[0x1],s[0x2],s[0x3],s[0x4],s[0x5],s[0x6],s[0x7],s[0x8],s[0x9],s[0xA],s[0xB],s[0xC],s[0xD],s[0xE],s[0xF]); */
+			/* We didn't get enough to parse a chunk, file ended before output finished. */
+			if (pR->iBytesRead < 8) {
+				pPage->iError = PNG_DECODE_ERROR;
+				//printf("decode1\n");
+				break;
+			}
+
+		}
+
+		if (pR->iCrcPending) {
+			if (MOTOLONG(&s[pR->iOffset]) != (uint32_t)pR->ulCrc) {
+				pPage->iError = PNG_DECODE_ERROR;
+				break;
+			}
+			pR->iOffset += 4;
+			pR->iCrcPending = 0;
+			if (pR->iStreamEnd) // that was the IDAT the image data ended in
+				pR->iCrcMore = 0;
+			continue;
+		}
+
+		if (!pR->iMarker) {
+			pR->iLen = MOTOLONG(&s[pR->iOffset]); // chunk length
+			//printf("zMark iL %d Offset %d\n", iLen, iOffset);
+			if (pR->iLen < 0 || (pPage->PNGFile.iSize > 0 &&
+				pR->iLen + (pR->iFileOffset - pR->iBytesRead) > pPage->PNGFile.iSize)) // invalid data
+			{
+				pPage->iError = PNG_DECODE_ERROR;
+				//printf("decode2\n");
+				break;
+			}
+			pR->iMarker = MOTOLONG(&s[pR->iOffset+4]);
+			if (pR->iOptions & PNG_CHECK_CHUNK_CRC) // the CRC covers the chunk type too
+				pR->ulCrc = crc32(0L, &s[pR->iOffset+4], 4);
+			pR->iOffset += 8; // point to the marker data
+			if (pR->y >= pR->iRows && !pR->iFramesLeft && pR->iMarker != 0x49444154 &&
+				pR->iMarker != 0x66644154) // no more IDATs (or fdATs) to check
+				break;
+			if ((pR->iOptions & PNG_ANIMATE) && pR->iMarker == 0x49444154 && !PNGFrameIdat(pPage)) {
+				pR->iMarker = 0; // the default image isn't one of the frames, skip it
+				pR->iOffset += (pR->iLen + 4);
+				continue;
+			}
+		}
+
+		/* Skip unknown chunks (by ... not skipping if one of the later-handled ones.) */
+		switch (pR->iMarker) {
+            case 0x504c5445: //'PLTE' palette colors
+			case 0x74524e53: //'tRNS' transparency info
+            case 0x49444154: //'IDAT' image data block
+			case 0x624b4744: //'bKGD' background color
+				break;
+			case 0x6163544c: //'acTL' APNG animation control, before the image data
+				if ((pR->iOptions & PNG_ANIMATE) && !pR->iIdatSeen)
+					break;
+				pR->iMarker = 0;
+				pR->iOffset += (pR->iLen + 4);
+				break;
+			case 0x6663544c: //'fcTL' frame control
+			case 0x66644154: //'fdAT' frame data
+				if (pR->iAnimated)
+					break;
+				// fall through
+			default:
+				pR->iMarker = 0;
+				pR->iOffset += (pR->iLen + 4); // skip data + CRC
+				break;
+		}
+		
+		if (!pR->iMarker)
+			continue;
+
+		left = pR->iBytesRead - pR->iOffset;
+
+		if (pR->iMarker == 0x66644154) { //'fdAT': a sequence number, then data like an IDAT's
+			if (left < 4) {
+				pR->more = 1;
+				continue;
+			}
+			if (pR->iLen < 4 || pR->iFrameData != 0x66644154 || MOTOLONG(&s[pR->iOffset]) != pR->iSeq) {
+				pPage->iError = PNG_DECODE_ERROR;
+				break;
+			}
+			pR->iSeq++;
+			if (pR->iOptions & PNG_CHECK_CHUNK_CRC)
+				pR->ulCrc = crc32(pR->ulCrc, &s[pR->iOffset], 4);
+			pR->iOffset += 4;
+			pR->iLen -= 4;
+			left -= 4;
+			pR->iMarker = 0x49444154;
+		}
+		
+		/* Check that we have enough data for the chunk, if it is not IDAT. */
+		if ((pR->iMarker != 0x49444154) && (left < pR->iLen)) {
+			/* If it were impossible to fetch this chunk into our buffer, abort. */
+			if (pR->iLen > pPage->iFileBufSize) {
+				pPage->iError = PNG_DECODE_ERROR;
+				break;
+			}
+			pR->more = 1;
+			continue;
+		}
+		
+        switch (pR->iMarker)
+        {
+			default: // PLTE, tRNS, bKGD, acTL
+				if (pR->iOptions & PNG_CHECK_CHUNK_CRC)
+					pR->ulCrc = crc32(pR->ulCrc, &s[pR->iOffset], (uInt)pR->iLen);
+				PNGParseChunk(pPage, pR->iMarker, &s[pR->iOffset], pR->iLen);
+				if (pR->iMarker == 0x6163544c && !pPage->iError) { // it is an APNG
+					pR->iAnimated = 1;
+					pR->iFramesLeft = pR->frame.iFrameCount = pPage->iFrameCount;
+					pR->frame.iLoopCount = pPage->iLoopCount;
+				}
+				pR->iMarker = 0;
+				break;
+			case 0x6663544c: //'fcTL' frame control
+				if (pR->iOptions & PNG_CHECK_CHUNK_CRC)
+					pR->ulCrc = crc32(pR->ulCrc, &s[pR->iOffset], (uInt)pR->iLen);
+				PNGFrameControl(pPage, &s[pR->iOffset], pR->iLen);
+				pR->iMarker = 0;
+				break;
+            case 0x49444154: //'IDAT' image data block
+                while (pR->iLen) {
+					int32_t chunk;
+                    if (pR->iOffset >= pR->iBytesRead) {
+                        // we ran out of data; get some more
+						if (strm->avail_in) { // (handed back, it gets fed again)
+							pR->iOffset -= strm->avail_in;
+							pR->iLen += strm->avail_in;
+							strm->avail_in = 0;
+						}
+						pR->more = 1;
+						break;
                     }
-                    if (err == Z_STREAM_END && d_stream.avail_out == 0) {
-                        // successful decode, stop here
-                        y = pPage->iHeight;
-						iMarker = 0;
+					chunk = pR->iBytesRead - pR->iOffset;
+					if (chunk > pR->iLen) chunk = pR->iLen;
+					if (pR->iStreamEnd) { // the image is done, only the CRC is left to check
+						pR->ulCrc = crc32(pR->ulCrc, &s[pR->iOffset], (uInt)chunk);
+						pR->iLen -= chunk;
+						pR->iOffset += chunk;
+						continue;
+					}
+                    strm->next_in  = &s[pR->iOffset];
+                    strm->avail_in = chunk;
+					
+                    pR->iLen -= chunk;
+                    pR->iOffset += chunk;
+                    err = 0;
+                    pIn = strm->next_in;
+                    while (err == Z_OK) {
+                        if (strm->avail_out == 0) { // reset for next line (or strip of lines)
+                            strm->avail_out = pR->iOutSize;
+                            strm->next_out = pR->pRow = pR->pOut;
+						} // otherwise it is a continuation of an unfinished line
+                        err = inflate(strm, Z_NO_FLUSH, pR->iOptions & PNG_CHECK_CRC);
+                        if (err != Z_OK && err != Z_STREAM_END)
+							break;
+						// defilter and draw all the lines that got completed
+						while ((strm->next_out - pR->pRow >= pR->iRowLen) && (pR->y < pR->iRows)) {
+							if (pR->iWinOut) // leave the inflated data as is
+								pLine = (pR->pPrev == pPage->uLine1) ? pPage->uLine2 : pPage->uLine1;
+							else
+								pLine = pR->pRow;
+							if (pPage->iInterlaced) { // (this can change iRowLen)
+								PNGDeFilterLine(pPage, pLine, pR->pRow, pR->pPrev, (int)pR->iRowLen - 1, NULL);
+								if (pPage->iError)
+									break;
+								PNGAdam7Line(pPage, pLine);
+							}
+#ifdef PNG_HAVE_THREADS
+							else if (pR->ring.pRows) { // PNGRunThreads() takes it from here
+								// (a bad filter byte is caught on this side, iError is this thread's)
+								if (pR->pRow[0] >= PNG_FILTER_COUNT) {
+									pPage->iError = PNG_DECODE_ERROR;
+									break;
+								}
+								PNGRingPut(&pR->ring, pR->pRow);
+							}
+#endif
+							else if (pR->iDrawBatch) {
+								pLine = PNGBatchLine(pPage, pR->pRow, pR->pPrev, pR->y);
+								if (pPage->iError)
+									break;
+							} else {
+								pBGR = PNGDeFilterLine(pPage, pLine, pR->pRow, pR->pPrev, pPage->iPitch,
+									pR->iFrameData ? NULL : pPage->pBGRLine);
+								if (pPage->iError)
+									break;
+								PNGPutLine(pPage, pLine, pBGR, pR->y, 0);
+							}
+                            pR->y++;
+							pR->pPrev = pLine;
+							pR->pRow += pR->iRowLen;
+							if (pR->y == pR->iRows && pR->iFrameData) // an APNG frame is done
+								PNGFrameDone(pPage);
+                        }
+						if (pPage->iError) // a bad filter byte
+							break;
+						if (strm->avail_out == 0 && !pR->iWinOut) {
+							if (pR->pOut == pPage->pStrip) {
+								// the strip gets overwritten, keep its last line for the next one
+								// (unless it got defiltered into pDrawRows)
+								if (!pR->iDrawBatch) {
+									memcpy(pPage->uLine2, pR->pPrev, pR->iRowLen);
+									pR->pPrev = pPage->uLine2;
+								}
+							} else {
+								// swap current and previous lines
+								pR->pOut = (pR->pPrev == pPage->uLine1) ? pPage->uLine2 : pPage->uLine1;
+							}
+						}
+                    }
+                    if (pPage->iError)
 						break;
-                    } else if (err == Z_DATA_ERROR || err == Z_STREAM_ERROR) {
+                    if (pR->iOptions & PNG_CHECK_CHUNK_CRC) // what inflate took, the rest may be handed back
+                        pR->ulCrc = crc32(pR->ulCrc, pIn, (uInt)(strm->next_in - pIn));
+                    if (err == Z_STREAM_END && pR->y >= pR->iRows) {
+                        // successful decode, stop here
+                        pR->y = pR->iRows;
+						if (!(pR->iOptions & PNG_CHECK_CHUNK_CRC)) {
+							strm->avail_in = 0; // the rest of the IDAT gets skipped
+							pR->iMarker = 0;
+							break;
+						}
+						// hand back the rest of this IDAT, for its CRC
+						pR->iStreamEnd = 1;
+						pR->iOffset -= strm->avail_in;
+						pR->iLen += strm->avail_in;
+						strm->avail_in = 0;
+                    } else if (err == Z_STREAM_END || err == Z_DATA_ERROR || err == Z_STREAM_ERROR) {
+                        // (the image data ending short of the last line too)
                         pPage->iError = PNG_DECODE_ERROR; // force loop to exit with error
 						//printf("decode3\n");
 						break;
                     }
                 } // while (iLen)
-				if (!iLen)
-					iMarker = 0;
+				if (!pR->iLen)
+					pR->iMarker = 0;
                 break;
 
         } // switch
-		if (!iMarker) {
-			iOffset += (iLen + 4); // skip data + CRC
+		if (!pR->iMarker) {
+			if ((pR->iOptions & PNG_CHECK_CHUNK_CRC) && (pR->iCrcMore || pR->iFramesLeft)) {
+				pR->iOffset += pR->iLen; // check the CRC on the next pass
+				pR->iCrcPending = 1;
+			} else {
+				pR->iOffset += (pR->iLen + 4); // skip data + CRC
+			}
 		}
     } // while y < height and no error
-    err = inflateEnd(&d_stream);
+    return pPage->iError;
+} /* PNGRun() */
+
+//
+// Done with a decode: free inflate, and make the image size the
+// canvas' again after APNG frames
+//
+static void PNGRunEnd(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+
+	PNGDrawRows(pPage);
+	inflateEnd(&pR->d_stream);
+	if (pR->iOptions & PNG_ANIMATE)
+		PNGFrameSize(pPage, pR->frame.iWidth, pR->frame.iHeight);
+} /* PNGRunEnd() */
+
+#ifdef PNG_HAVE_THREADS
+static void *PNGRingThread(void *p)
+{
+	PNGIMAGE *pPage = (PNGIMAGE *)p;
+	PNGRING *pRing = &pPage->run.ring;
+
+	PNGRun(pPage);
+	__atomic_store_n(&pRing->iEnd, 1, __ATOMIC_SEQ_CST);
+	PNGRingWake(pRing);
+	return NULL;
+} /* PNGRingThread() */
+
+//
+// PNG_THREADS: PNGRun() reads and inflates on a thread of its own, putting
+// the rows in the ring, and they get defiltered (in place) and drawn here
+//
+static void PNGRunThreads(PNGIMAGE *pPage)
+{
+	PNGRUN *pR = &pPage->run;
+	PNGRING *pRing = &pR->ring;
+	pthread_t t;
+	uint8_t *pRow, *pPrev, *pBGR;
+	int32_t n;
+	int y, iDrawBatch = pR->iDrawBatch;
+
+	pRing->pRows = pPage->pRing;
+	pRing->iSlots = pPage->iRingRows;
+	pRing->iRowLen = pPage->iPitch + 1;
+	pRing->iPut = pRing->iDone = 1;
+	memset(pRing->pRows, 0, (size_t)pRing->iRowLen); // row 0
+	pthread_mutex_init(&pRing->mutex, NULL);
+	pthread_cond_init(&pRing->cond, NULL);
+	pR->iDrawBatch = 0; // the batch is this side's, PNGRun() leaves it alone
+	if (pthread_create(&t, NULL, PNGRingThread, pPage) != 0) {
+		pRing->pRows = NULL; // all on this thread after all
+		pR->iDrawBatch = iDrawBatch;
+		PNGRun(pPage);
+	} else {
+		pPrev = pRing->pRows; // row 0
+		// (the rows in the ring all have good filter bytes, PNGRun() saw to that)
+		for (y = 0; (pRow = PNGRingGet(pRing)) != NULL; y++) {
+			n = pRing->iDone;
+			if (iDrawBatch) { // out of the ring into pDrawRows
+				pPrev = PNGBatchLine(pPage, pRow, pPrev, y);
+			} else { // in place, the previous line is still in the ring
+				pPrev = &pRing->pRows[((n - 1) % pRing->iSlots) * pRing->iRowLen];
+				pBGR = PNGDeFilterLine(pPage, pRow, pRow, pPrev, pPage->iPitch, pPage->pBGRLine);
+				PNGDrawLines(pPage, pRow, pBGR, y, 1, 0);
+			}
+			__atomic_store_n(&pRing->iDone, n + 1, __ATOMIC_SEQ_CST);
+			PNGRingWake(pRing);
+		}
+		pthread_join(t, NULL);
+		pRing->pRows = NULL;
+	}
+	pthread_cond_destroy(&pRing->cond);
+	pthread_mutex_destroy(&pRing->mutex);
+} /* PNGRunThreads() */
+#endif // PNG_HAVE_THREADS
+
+//
+// Decode the PNG file
+//
+// You must call open() before calling decode()
+// This function can be called repeatedly without having
+// to close and re-open the file
+//
+
+int PNG_decode(PNGIMAGE *pPage, long User, int iOptions)
+{
+	PNGRUN *pR = &pPage->run;
+
+	if (PNGCheckBuffers(pPage, iOptions))
+		return pPage->iError;
+    pPage->iError = PNG_SUCCESS;
+#ifdef PNG_HAVE_INFBACK
+	// that one goes line by line, and takes one zlib stream
+	if ((iOptions & PNG_USE_INFBACK) && !pPage->iInterlaced && !(iOptions & PNG_ANIMATE))
+		return PNGDecodeBack(pPage, User, iOptions);
+#endif
+	PNGRunStart(pPage, User, iOptions);
+	pR->s = PNGStartChunks(pPage, &pR->iFileOffset, &pR->iBytesRead, &pR->iOffset);
+	if (pR->s == NULL)
+		pPage->iError = PNG_IO_ERROR;
+#ifdef PNG_HAVE_THREADS
+	else if ((iOptions & PNG_THREADS) && !pPage->iInterlaced && !(iOptions & PNG_ANIMATE))
+		PNGRunThreads(pPage);
+#endif
+	else
+		PNGRun(pPage);
+	PNGRunEnd(pPage);
     return pPage->iError;
 } /* DecodePNG() */
+
+//
+// Get ready to decode a PNG file that gets handed to PNG_decodeFeed()
+// piece by piece, from its first byte on: no PNG_init() and no read/seek
+// callbacks. Set pfnHeader to allocate the buffers once the size is known.
+// (no PNG_USE_INFBACK or PNG_THREADS here, inflateBack() pulls its input
+// and the lines get drawn as the data comes in anyway)
+//
+int PNG_beginFeed(PNGIMAGE *pPage, long User, int iOptions)
+{
+	PNGRUN *pR = &pPage->run;
+
+	memset(pR, 0, sizeof(PNGRUN));
+	pR->User = User;
+	pR->iOptions = iOptions & ~(PNG_USE_INFBACK | PNG_THREADS);
+	pR->iFeed = PNG_FEED_INFO;
+	pPage->PNGFile.iPos = 0; // header bytes gathered so far
+	pPage->PNGFile.iSize = 0; // not known
+	pPage->PNGFile.pData = NULL;
+	pPage->iError = PNG_SUCCESS;
+	return PNG_SUCCESS;
+} /* PNG_beginFeed() */
+
+//
+// Decode the next iLen bytes of the file, drawing the lines they complete
+// returns PNG_NEED_MORE until the image is done, then 0 for success
+// or the error code (running out of data while it wants more means
+// the file is cut short)
+//
+int PNG_decodeFeed(PNGIMAGE *pPage, const uint8_t *pData, int32_t iLen)
+{
+	PNGRUN *pR = &pPage->run;
+	uint8_t *s;
+	int32_t n, left;
+	int rc;
+
+	if (pR->iFeed == PNG_FEED_DONE)
+		return pPage->iError;
+	if (pR->iFeed != PNG_FEED_INFO && pR->iFeed != PNG_FEED_CHUNKS) { // no PNG_beginFeed()
+		pPage->iError = PNG_INVALID_PARAMETER;
+		return pPage->iError;
+	}
+	if (pR->iFeed == PNG_FEED_INFO) {
+		// gather what PNG_init() would read into ucFileBuf
+		n = PNG_INFO_SIZE - (int32_t)pPage->PNGFile.iPos;
+		if (n > iLen) n = iLen;
+		memcpy(&pPage->ucFileBuf[pPage->PNGFile.iPos], pData, n);
+		pPage->PNGFile.iPos += n;
+		pData += n;
+		iLen -= n;
+		if (pPage->PNGFile.iPos < PNG_INFO_SIZE)
+			return PNG_NEED_MORE;
+		pR->iFeed = PNG_FEED_DONE; // unless the decode gets going
+		rc = PNGParseHeader(pPage, pPage->ucFileBuf);
+		if (rc != PNG_SUCCESS) {
+			pPage->iError = rc;
+			return rc;
+		}
+		if (pPage->pfnHeader)
+			(*pPage->pfnHeader)(pPage, pR->User);
+		if (PNGCheckBuffers(pPage, pR->iOptions))
+			return pPage->iError;
+		PNGRunStart(pPage, pR->User, pR->iOptions);
+		// the chunks start after the signature
+		memmove(pPage->pFileBuf, &pPage->ucFileBuf[8], PNG_INFO_SIZE - 8);
+		pR->s = pPage->pFileBuf;
+		pR->iFileOffset = PNG_INFO_SIZE;
+		pR->iBytesRead = PNG_INFO_SIZE - 8;
+		pR->iFeed = PNG_FEED_CHUNKS;
+	}
+	s = pR->s;
+	do {
+		// keep what is left in s, and add as much of the new data as fits
+		if (pR->iOffset < 0) { // handed back more than s still has
+			pPage->iError = rc = PNG_DECODE_ERROR;
+			break;
+		}
+		left = pR->iBytesRead - pR->iOffset;
+		if (left < 0) { // skipping past what we had
+			n = -left;
+			if (n > iLen) n = iLen;
+			pData += n;
+			iLen -= n;
+			pR->iFileOffset += n;
+			left += n;
+			if (left < 0) {
+				pR->iBytesRead = 0;
+				pR->iOffset = -left;
+				return PNG_NEED_MORE;
+			}
+		} else if (pR->iOffset) {
+			memmove(s, s+pR->iOffset, left);
+		}
+		n = pPage->iFileBufSize - left;
+		if (n > iLen) n = iLen;
+		memcpy(s+left, pData, n);
+		pData += n;
+		iLen -= n;
+		pR->iFileOffset += n;
+		pR->iBytesRead = left + n;
+		pR->iOffset = 0;
+		pR->more = 0;
+		rc = PNGRun(pPage);
+	} while (rc == PNG_NEED_MORE && iLen > 0);
+	if (rc != PNG_NEED_MORE) {
+		PNGRunEnd(pPage);
+		pR->iFeed = PNG_FEED_DONE;
+	} else { // draw what there is before asking for more
+		PNGDrawRows(pPage);
+	}
+	return rc;
+} /* PNG_decodeFeed() */
@@ -52,6 +52,20 @@ typedef signed long off_t;
 #endif
 /* Defines and variables */
 #define PNG_FILE_BUF_SIZE 2048
+// default byte budget for the multi-row inflate strip (see PNG_getStripRows)
+#ifdef LINUX
+#define PNG_STRIP_BUDGET 65536L
+#else
+#define PNG_STRIP_BUDGET 8192L
+#endif
+// chunks PNG_probe() keeps in the index (it counts them all)
+#ifdef LINUX
+#define PNG_MAX_CHUNKS 64
+#else
+#define PNG_MAX_CHUNKS 16
+#endif
+// scratch bytes needed after the strip, inflate's match copies may run into them
+#define PNG_STRIP_PAD 16
 
 // PNG filter type
 enum {
@@ -66,8 +80,30 @@ enum {
 // decode options
 enum {
     PNG_CHECK_CRC = 1,
+    PNG_USE_INFBACK = 2, // decode with inflateBack() callbacks (PNG_HAVE_INFBACK)
+    PNG_CHECK_CHUNK_CRC = 4, // verify the CRC-32 of the chunks decoded (PLTE, tRNS, bKGD, IDAT)
+    PNG_PROGRESSIVE = 8, // interlaced images: draw the whole (coarse) image after each Adam7 pass
+    PNG_ANIMATE = 16, // APNG: put the frames together in pCanvas and hand them to pfnFrame
+    PNG_THREADS = 32, // inflate on a thread of its own, the rows come over in pRing (PNG_HAVE_THREADS)
 };
 
+// APNG frame dispose and blend ops (fcTL)
+enum {
+    PNG_DISPOSE_NONE = 0, // leave the canvas as it is for the next frame
+    PNG_DISPOSE_BACKGROUND, // clear the frame's region to transparent black
+    PNG_DISPOSE_PREVIOUS // put the region back the way it was before the frame
+};
+enum {
+    PNG_BLEND_SOURCE = 0, // the frame's pixels replace the canvas'
+    PNG_BLEND_OVER // the frame gets alpha composited over the canvas
+};
+
+#ifdef LINUX
+#define PNG_HAVE_INFBACK // infback.c is linked in (see linux.sh)
+#define PNG_HAVE_THREADS // built with -pthread (see linux.sh)
+#include <pthread.h>
+#endif
+
 // source pixel type
 enum {
 	PNG_PIXEL_GRAYSCALE=0,
@@ -86,7 +122,8 @@ enum {
     PNG_NO_BUFFER,	// 4
     PNG_UNSUPPORTED_FEATURE, // 5
     PNG_INVALID_FILE, // 6
-    PNG_TOO_BIG // 7
+    PNG_TOO_BIG, // 7
+    PNG_NEED_MORE // 8, not an error: PNG_decodeFeed() wants more data
 };
 
 typedef struct png_draw_tag
@@ -97,6 +134,9 @@ typedef struct png_draw_tag
     int iPixelType; // PNG pixel type (0,2,3,4,6)
     int iBpp; // bits per color stimulus
     int iHasAlpha; // flag indicating the presence of an alpha palette
+    int iPass; // Adam7 pass (1-7) this line is from for PNG_PROGRESSIVE, 0 for final lines
+    int iRows; // lines in this call, y being the first (see PNGIMAGE.iDrawRows)
+    int iStride; // bytes from one line's pPixels to the next's (pBGR: iWidth*3)
 	// Transparent pixel value like seen in the data proper
 	uint8_t iTrans[6];
 	uint8_t iTransLen;
@@ -106,19 +146,135 @@ typedef struct png_draw_tag
     long User; // user supplied value (output fd for this app)
     uint8_t *pPalette;
     uint8_t *pPixels;
+    // the line as BMP pixels when PNGIMAGE.pBGRLine is set and the
+    // defilter loops could do it (8-bit truecolor), NULL otherwise
+    uint8_t *pBGR;
 } PNGDRAW;
 
 typedef struct png_file_tag
 {
   off_t iPos; // current file position
-  off_t iSize; // file size
+  off_t iSize; // file size, 0 if not known (a stream)
   long fHandle;
+  uint8_t *pData; // all iSize bytes of the file in memory (e.g. mmap'ed), or NULL
 } PNGFILE;
 
+//
+// One entry of the chunk index PNG_probe() fills in
+//
+typedef struct png_chunk_tag
+{
+	uint32_t iType; // chunk type, e.g. 0x49444154 for 'IDAT'
+	off_t iOffset; // file position of the chunk (of its length)
+	int32_t iLen; // length of the chunk data
+} PNGCHUNK;
+
+//
+// An APNG frame, handed to the frame callback once it is in the canvas
+//
+typedef struct png_frame_tag
+{
+	int32_t iFrame; // frame number, 0 on up
+	int32_t iFrameCount; // frames in the animation (acTL), 1 if it isn't one
+	int32_t iLoopCount; // times to play it, 0 for forever
+	int32_t iWidth, iHeight; // canvas size (the image's)
+	int32_t iX, iY, iFrameWidth, iFrameHeight; // the region the frame drew in
+	uint16_t usDelayNum, usDelayDen; // how long to show it, in seconds
+	uint8_t ucDispose, ucBlend; // PNG_DISPOSE_*, PNG_BLEND_*
+	int32_t iBackground; // background color (bKGD or 0x999999) as 0xBBGGRR
+	long User; // user supplied value (output fd for this app)
+	uint8_t *pCanvas; // iWidth*iHeight pixels, 8-bit RGBA
+} PNGFRAME;
+
+struct png_image_tag;
+
 // Callback function prototypes
 typedef int32_t (PNG_READ_CALLBACK)(PNGFILE *pFile, uint8_t *pBuf, int32_t iLen);
 typedef void (PNG_SEEK_CALLBACK)(PNGFILE *pFile, off_t iPosition);
 typedef void (PNG_DRAW_CALLBACK)(PNGDRAW *);
+typedef void (PNG_HEADER_CALLBACK)(struct png_image_tag *, long User);
+typedef void (PNG_FRAME_CALLBACK)(PNGFRAME *);
+// one filter type undone on one line, pointers past the filter byte
+typedef void (PNG_DEFILTER_FUNC)(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch);
+// the same, also putting each pixel in pBGR as it comes out: B, G, R over
+// the background ulBg (0xBBGGRR), ulTrans being the tRNS color (0xBBGGRR,
+// 0xFFFFFFFF for none)
+typedef void (PNG_DEFILTER_BGR_FUNC)(uint8_t *pCurr, const uint8_t *pSrc, const uint8_t *pPrev, int iBpp, int iPitch,
+	uint8_t *pBGR, uint32_t ulBg, uint32_t ulTrans);
+
+#ifdef PNG_HAVE_THREADS
+//
+// PNG_THREADS: the filtered rows on their way from the inflate thread to
+// the one that defilters and draws them. Rows count from 1, row 0 being
+// the zeros above the first one; the drawing side keeps the last row it
+// did as the previous row, so rows iDone-1 to iPut-1 are in use. Each
+// side only writes its own count, and only takes the mutex to sleep when
+// the ring is full (or empty).
+//
+typedef struct png_ring_tag
+{
+	uint8_t *pRows; // iSlots rows of iRowLen bytes, NULL when not in use
+	int iSlots;
+	int32_t iRowLen;
+	int32_t iPut; // the next row to go in
+	int32_t iDone; // the next row to come out
+	int iEnd; // no more rows are coming
+	int iSleepers;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} PNGRING;
+#endif
+
+//
+// State of the chunk walk and inflate of a decode, kept in PNGIMAGE
+// so that PNG_decodeFeed() can carry on with it when more data comes in
+//
+typedef struct png_run_tag
+{
+	z_stream d_stream;
+	uint8_t *s; // pFileBuf, or the file itself when it is in memory
+	off_t iFileOffset; // file position of s[iBytesRead]
+	int32_t iBytesRead; // bytes in s
+	int32_t iOffset; // our position in s, past iBytesRead while skipping data
+	int32_t iLen; // bytes left in the current chunk
+	uint32_t iMarker; // current chunk type, 0 between chunks
+	uLong ulCrc; // CRC of the current chunk so far (PNG_CHECK_CHUNK_CRC)
+	int iCrcPending; // the CRC of the last chunk is next in the file
+	int iCrcMore; // IDAT data may follow the last line
+	int iStreamEnd; // inflate is done, what is left of the IDATs only gets its CRC checked
+	int more; // the current chunk needs more data than s has
+	int y;
+	uint8_t *pOut, *pRow, *pPrev;
+	int iWinOut; // inflated data is also inflate's window, defilter it elsewhere
+	int32_t iRowLen; // filter byte + pitch
+	uInt iOutSize; // bytes inflated into pOut per go
+	long User;
+	int iOptions;
+	int iFeed; // PNG_decodeFeed() stage, 0 for PNG_decode()
+	int32_t iRows; // filtered lines in the image data (of all the passes when interlaced)
+	// Adam7: current pass (0-6), its size and the line in it, and the
+	// next image line to draw
+	int iPass;
+	int32_t iPassWidth, iPassRows, iPassRow;
+	int32_t iDrawY;
+	// APNG (PNG_ANIMATE): the frame being decoded, the frames left to go,
+	// the data chunk it comes in (0 until its fcTL) and the next sequence number
+	PNGFRAME frame;
+	int32_t iFramesLeft;
+	uint32_t iFrameData;
+	uint32_t iSeq;
+	int iAnimated; // an acTL came before the image data
+	int iIdatSeen;
+	// what gets handed to pfnDraw, filled in with the first lines; and the
+	// iBatched lines (from iBatchY on) waiting in pDrawRows
+	PNGDRAW draw;
+	int iDrawBatch; // the lines go through pDrawRows
+	int iBatched, iBatchY;
+	uint8_t *pBatchBGR;
+#ifdef PNG_HAVE_THREADS
+	PNGRING ring;
+#endif
+} PNGRUN;
 
 
 //
@@ -135,25 +291,90 @@ typedef struct png_image_tag
     uint8_t iTrans[6]; // transparent color index/value
 	uint8_t iTransLen;
 	uint32_t iBackground;
+	// bytes per pixel the filters go by (1 for less than a byte), and the
+	// loops for that size, picked once IHDR is parsed
+	int iFilterBpp;
+	PNG_DEFILTER_FUNC *pfnDeFilter[PNG_FILTER_COUNT];
+	PNG_DEFILTER_BGR_FUNC *pfnDeFilterBGR[PNG_FILTER_COUNT]; // NULL but for 8-bit truecolor without PNG_DEFILTER_SIMD
     int iError;
     PNG_READ_CALLBACK *pfnRead;
-    PNG_SEEK_CALLBACK *pfnSeek;
+    PNG_SEEK_CALLBACK *pfnSeek; // NULL for a stream (pipe): the file gets read once, front to back
     PNG_DRAW_CALLBACK *pfnDraw;
+    // PNG_decodeFeed() calls this once IHDR is parsed, to allocate the
+    // line (and strip, file) buffers now that iPitch is known
+    PNG_HEADER_CALLBACK *pfnHeader;
+    PNG_FRAME_CALLBACK *pfnFrame; // PNG_ANIMATE: called with each frame put together
 
     PNGFILE PNGFile;
     uint8_t ucZLIB[32768 + sizeof(struct inflate_state)]; // put this here to avoid needing malloc/free
     uint8_t ucPalette[1024];
 	
     uint8_t ucFileBuf[PNG_FILE_BUF_SIZE]; // holds temp file data
+	// Optional bigger file buffer of iFileBufSize bytes (at least
+	// PNG_FILE_BUF_SIZE) for fewer, larger reads; if NULL, PNG_decode()
+	// points it at ucFileBuf.
+	uint8_t *pFileBuf;
+	int32_t iFileBufSize;
 	uint8_t *uLine1;
 	uint8_t *uLine2;
+	// Optional strip buffer: inflate writes iStripRows filtered lines
+	// (iPitch+1 bytes each) into it in one go, so inflate_fast() gets
+	// to run even for narrow images. uLine2 holds the previous line
+	// across strips.
+	// A strip of iHeight lines holds the whole image; inflate then uses
+	// it as its history and leaves the window in ucZLIB alone, and the
+	// lines get defiltered into uLine1/uLine2 instead.
+	// Allocate PNG_STRIP_PAD bytes more than the lines take.
+	uint8_t *pStrip;
+	int iStripRows;
+	// Interlaced images get put together in this buffer of
+	// PNG_getDeinterlaceSize() bytes: the even lines (all the lines for
+	// PNG_PROGRESSIVE), the odd ones come whole in the last pass.
+	uint8_t *pDeinterlace;
+	// PNG_ANIMATE: the canvas the frames get put together in, of
+	// PNG_getCanvasSize() bytes; the second half keeps what a
+	// PNG_DISPOSE_PREVIOUS frame draws over.
+	uint8_t *pCanvas;
+	// Optional line of iWidth*3 bytes: 8-bit truecolor lines (with or
+	// without alpha) then also get converted to BMP pixels (B, G, R,
+	// blended over iBGRBackground) in the same pass that undoes the
+	// filter, and PNGDRAW.pBGR points here. The defiltered line is still
+	// there in pPixels, as the next line's filter needs it anyway.
+	// Not for interlaced lines or APNG frames.
+	uint8_t *pBGRLine;
+	int32_t iBGRBackground; // 0xBBGGRR, -1 for the image's (bKGD or gray)
+	// Optional: iDrawRows (2 or more) rows of iPitch+1 bytes. The lines
+	// then get defiltered into it and handed to pfnDraw iDrawRows at a
+	// time (PNGDRAW.iRows, fewer at the end), and pBGRLine has to hold
+	// that many lines too. Interlaced images still come a line at a time.
+	uint8_t *pDrawRows;
+	int iDrawRows;
+	// PNG_THREADS: iRingRows (2 or more) rows of iPitch+1 bytes for the
+	// inflate thread to hand the lines over in. Only PNG_decode() of an
+	// image that is not interlaced goes threaded, without PNG_ANIMATE or
+	// PNG_USE_INFBACK; then pfnRead and pfnSeek get called on the inflate
+	// thread, pfnDraw on the one that called PNG_decode().
+	uint8_t *pRing;
+	int iRingRows;
+	PNGRUN run;
+	// Filled in by PNG_probe(): the first PNG_MAX_CHUNKS of the
+	// iChunkCount chunks after the signature, and the image data size
+	PNGCHUNK chunks[PNG_MAX_CHUNKS];
+	int iChunkCount;
+	int iIdatCount;
+	int32_t iIdatSize; // compressed bytes in all the IDATs
+	int32_t iFrameCount, iLoopCount; // from acTL (APNG), 0 if none seen
 	
 } PNGIMAGE;
 
 #define PNG_STATIC
 
 int PNG_init(PNGIMAGE* pPNG);
+int PNG_openRAM(PNGIMAGE *pPNG, uint8_t *pData, int32_t iDataSize);
+int PNG_probe(PNGIMAGE *pPNG);
 int PNG_decode(PNGIMAGE *pPNG, long User, int iOptions);
+int PNG_beginFeed(PNGIMAGE *pPNG, long User, int iOptions);
+int PNG_decodeFeed(PNGIMAGE *pPNG, const uint8_t *pData, int32_t iLen);
 int PNG_getLastError(PNGIMAGE *pPNG);
 int PNG_getBpp(PNGIMAGE *pPNG);
 int PNG_getLastError(PNGIMAGE *pPNG);
@@ -161,6 +382,9 @@ uint8_t *PNG_getPalette(PNGIMAGE *pPNG);
 int PNG_getPixelType(PNGIMAGE *pPNG);
 int PNG_hasAlpha(PNGIMAGE *pPNG);
 int PNG_isInterlaced(PNGIMAGE *pPNG);
+int PNG_getStripRows(PNGIMAGE *pPNG, int32_t iBudget);
+int32_t PNG_getDeinterlaceSize(PNGIMAGE *pPNG, int iOptions);
+int32_t PNG_getCanvasSize(PNGIMAGE *pPNG);
 
 
 // Due to unaligned memory causing an exception, we have to do these macros the slow way
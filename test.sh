@@ -0,0 +1,8 @@
+#!/bin/sh
+# Build and run the checks in tests/
+set -e
+WF="-Wall -Wextra -Wno-implicit-fallthrough"
+ZLIB="adler32.c inflate.c infback.c crc32.c inffast.c inftrees.c zutil.c"
+gcc -O2 $WF -std=gnu89 -DLINUX -pthread -o dectest tests/decode.c $ZLIB && ./dectest
+gcc -O2 $WF -std=gnu89 -DLINUX -DPNG_TEST -pthread -o deftest tests/defilter.c $ZLIB && ./deftest
+gcc -O2 $WF -std=gnu89 -DLINUX -pthread -o blendtest tests/blend.c $ZLIB && ./blendtest
@@ -0,0 +1,136 @@
+/* adlerbench - check adler32_z() with each of the SIMD loops adler32.c
+ * has against the scalar loop, for every length up to a few blocks and
+ * around NMAX, at every alignment; then time them on line sized and image
+ * sized buffers. Built and run by bench.sh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../adler32.c"
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* adler32_z() over buf, len bytes at a time, for about total bytes in all;
+ * returns MB/s, the checksum in *sum */
+static double run(const Bytef *buf, z_size_t len, double total, uLong *sum)
+{
+	long i, n = (long)(total / len) + 1;
+	uLong a = 1;
+	double t = now();
+
+	for (i = 0; i < n; i++)
+		a = adler32_z(a, buf, len);
+	t = now() - t;
+	*sum = a;
+	return (double)n * len / t / 1e6;
+}
+
+/* adler32_z() of len bytes at buf + align with fn and with the scalar
+ * loop, from a few starting values; returns the mismatches */
+static int check(uLong (*fn) OF((unsigned long, unsigned long, const Bytef *, z_size_t)),
+	const char *name, const Bytef *buf, z_size_t len, int align)
+{
+	static const uLong starts[] = { 1, 0xfff0fff0UL, 0x12345678UL };
+	uLong sum, ref;
+	int i, bad = 0;
+
+	for (i = 0; i < 3; i++) {
+		adler32_simd = Z_NULL;
+		ref = adler32_z(starts[i], buf + align, len);
+		adler32_simd = fn;
+		sum = adler32_z(starts[i], buf + align, len);
+		if (sum != ref && bad++ < 1)
+			printf("%s: %lu bytes at +%d from %08lx: %08lx, not %08lx\n", name,
+				(unsigned long)len, align, starts[i], sum, ref);
+	}
+	return bad;
+}
+
+int main(void)
+{
+	static const z_size_t sizes[] = {
+		1 + 640 * 3,      /* a 640 pixel RGB line, with its filter byte */
+		1 + 1920 * 4,     /* a 1920 pixel RGBA line */
+		1920L * 1080 * 4  /* a whole 1920x1080 RGBA image */
+	};
+	struct {
+		const char *name;
+		uLong (*fn) OF((unsigned long, unsigned long, const Bytef *, z_size_t));
+	} loops[3];
+	int nloops = 0, s, l, bad = 0;
+	Bytef *buf;
+	uLong sum, ref;
+	double mbs;
+
+	loops[nloops].name = "scalar";
+	loops[nloops++].fn = Z_NULL;
+#ifdef ADLER32_SIMD
+	if (__builtin_cpu_supports("ssse3")) {
+		loops[nloops].name = "ssse3";
+		loops[nloops++].fn = adler32_ssse3;
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		loops[nloops].name = "avx2";
+		loops[nloops++].fn = adler32_avx2;
+	}
+#endif
+	buf = malloc(sizes[2]);
+	if (!buf)
+		return 2;
+	srand(1);
+	for (s = 0; s < (int)sizes[2]; s++)
+		buf[s] = (Bytef)rand();
+
+#ifdef ADLER32_SIMD
+	/* random bytes, then all 0xff for the largest sums */
+	for (s = 0; s < 2; s++) {
+		z_size_t len;
+		int a, n = 0;
+
+		if (s)
+			memset(buf, 0xff, 4 * NMAX + 64);
+		for (l = 1; l < nloops; l++) {
+			for (a = 0; a < 32; a++) {
+				for (len = 0; len <= 8 * SIMD_BLOCK + 3; len++, n++)
+					bad += check(loops[l].fn, loops[l].name, buf, len, a);
+				for (len = NMAX - 33; len <= NMAX + 33; len++, n++)
+					bad += check(loops[l].fn, loops[l].name, buf, len, a);
+				for (len = 3 * NMAX - 7; len <= 3 * NMAX + 7; len += 2, n++)
+					bad += check(loops[l].fn, loops[l].name, buf, len, a);
+			}
+		}
+		printf("%s bytes: %d lengths and alignments checked\n", s ? "0xff" : "random", n);
+	}
+	for (s = 0; s < 4 * NMAX + 64; s++)
+		buf[s] = (Bytef)rand();
+	if (bad)
+		printf("%d checksums WRONG\n", bad);
+#endif
+
+	for (s = 0; s < 3; s++) {
+		printf("%8lu bytes:", (unsigned long)sizes[s]);
+		ref = 0;
+		for (l = 0; l < nloops; l++) {
+#ifdef ADLER32_SIMD
+			adler32_simd = loops[l].fn;
+#endif
+			mbs = run(buf, sizes[s], 2e9, &sum);
+			if (l == 0)
+				ref = sum;
+			else if (sum != ref)
+				bad++;
+			printf("  %s %7.0f MB/s%s", loops[l].name, mbs, (sum != ref) ? " (WRONG SUM)" : "");
+		}
+		printf("\n");
+	}
+	free(buf);
+	return bad ? 1 : 0;
+}
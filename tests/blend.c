@@ -0,0 +1,112 @@
+/* blend - check the alpha blend against (c * a + bg * (255 - a)) / 255
+ * rounded to nearest, for every color c, background bg and alpha a: the
+ * scalar PNG_BLEND255 and PNG_PUT_BGR, and the SSSE3/AVX2 RGBA to BGR
+ * loops when the CPU has them, on 8 and 16-bit lines.
+ * Built and run by test.sh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "../pngdec.h"
+#include "../zlib.h"
+
+#include "../png.inl"
+
+#define LINE_PIXELS (256 * 256 + 7) /* every (c, a), and a few left over */
+
+static uint8_t line[LINE_PIXELS * 8], bgr[LINE_PIXELS * 3];
+static long values, bad;
+
+/* what c over bg at alpha a should come out as */
+static unsigned blend(unsigned c, unsigned bg, unsigned a)
+{
+	return (2 * (c * a + bg * (255 - a)) + 255) / 510;
+}
+
+/* the three channels of a pixel, told apart so a swap shows */
+static unsigned chan(unsigned v, int k)
+{
+	return k == 0 ? v : (k == 1 ? 255 - v : v ^ 0x55);
+}
+
+static void expect(const char *name, unsigned got, unsigned want, unsigned c, unsigned bg, unsigned a)
+{
+	values++;
+	if (got != want && bad++ < 10)
+		printf("%s: c %u bg %u a %u: %u, not %u\n", name, c, bg, a, got, want);
+}
+
+static void checkScalar(void)
+{
+	unsigned c, bg, a;
+	uint32_t ulBg;
+	uint8_t p[4], o[3];
+	int k;
+
+	for (bg = 0; bg < 256; bg++) {
+		ulBg = chan(bg, 0) | (chan(bg, 1) << 8) | ((uint32_t)chan(bg, 2) << 16);
+		for (a = 0; a < 256; a++) {
+			for (c = 0; c < 256; c++) {
+				expect("PNG_BLEND255", PNG_BLEND255(c, bg, a), blend(c, bg, a), c, bg, a);
+				for (k = 0; k < 3; k++)
+					p[k] = (uint8_t)chan(c, k);
+				p[3] = (uint8_t)a;
+				PNG_PUT_BGR(o, p, 4, ulBg, 0);
+				for (k = 0; k < 3; k++)
+					expect("PNG_PUT_BGR", o[2 - k], blend(chan(c, k), chan(bg, k), a), c, bg, a);
+			}
+		}
+	}
+}
+
+#ifdef PNG_DEFILTER_SIMD
+/* a line of iBpp byte RGBA pixels, pixel i being c = i & 0xff at alpha
+ * i >> 8, put out as BGR over each background in turn */
+static void checkSimd(void (*pfn)(uint8_t *, const uint8_t *, int, int, uint32_t), const char *name, int iBpp)
+{
+	const int iWide = (iBpp == 8);
+	unsigned c, bg, a;
+	uint32_t ulBg;
+	int i, k;
+
+	for (i = 0; i < LINE_PIXELS; i++) {
+		for (k = 0; k < 4; k++) {
+			/* (the low byte of a 16-bit sample is noise) */
+			line[i * iBpp + (k << iWide)] = (uint8_t)(k < 3 ? chan(i & 0xff, k) : (i >> 8) & 0xff);
+			if (iWide)
+				line[i * iBpp + 2 * k + 1] = (uint8_t)rand();
+		}
+	}
+	for (bg = 0; bg < 256; bg++) {
+		ulBg = chan(bg, 0) | (chan(bg, 1) << 8) | ((uint32_t)chan(bg, 2) << 16);
+		memset(bgr, 0xcc, sizeof(bgr));
+		(*pfn)(bgr, line, iBpp, LINE_PIXELS, ulBg);
+		for (i = 0; i < LINE_PIXELS; i++) {
+			c = i & 0xff;
+			a = (i >> 8) & 0xff;
+			for (k = 0; k < 3; k++)
+				expect(name, bgr[i * 3 + 2 - k], blend(chan(c, k), chan(bg, k), a), c, bg, a);
+		}
+	}
+}
+#endif
+
+int main(void)
+{
+	checkScalar();
+#ifdef PNG_DEFILTER_SIMD
+	if (__builtin_cpu_supports("ssse3")) {
+		checkSimd(PNGToBGRSSSE3, "PNGToBGRSSSE3 RGBA8", 4);
+		checkSimd(PNGToBGRSSSE3, "PNGToBGRSSSE3 RGBA16", 8);
+	}
+	if (__builtin_cpu_supports("avx2")) {
+		checkSimd(PNGToBGRAVX2, "PNGToBGRAVX2 RGBA8", 4);
+		checkSimd(PNGToBGRAVX2, "PNGToBGRAVX2 RGBA16", 8);
+	}
+#endif
+	printf("blend: %ld values, %ld bad\n", values, bad);
+	return bad != 0;
+}
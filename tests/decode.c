@@ -0,0 +1,322 @@
+/* decode - build small PNG files in memory, decode them with PNG_openRAM()
+ * and check what comes out: the chunks parsed, the lines drawn, and the
+ * errors for files that are wrong.
+ * Built and run by test.sh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "../pngdec.h"
+#include "../zlib.h"
+
+#include "../png.inl"
+
+#define MAX_FILE 65536
+#define MAX_LINE 4096
+
+static PNGIMAGE png;
+static uint8_t file[MAX_FILE], raw[MAX_FILE], line1[MAX_LINE], line2[MAX_LINE];
+static uint8_t image[MAX_FILE], deinterlace[MAX_FILE], strip[MAX_FILE], rows[MAX_FILE];
+static int32_t fileLen, rawLen;
+static long checks, bad;
+
+static void expect(const char *what, long got, long want)
+{
+	checks++;
+	if (got != want && bad++ < 20)
+		printf("%s: %ld (0x%lx), not %ld (0x%lx)\n", what, got, got, want, want);
+}
+
+static void put32(uint8_t *p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+/* append a chunk of len bytes to the file, with its CRC */
+static void chunk(const char *type, const uint8_t *data, int32_t len)
+{
+	uint8_t *p = &file[fileLen];
+
+	put32(p, (uint32_t)len);
+	memcpy(p + 4, type, 4);
+	if (len)
+		memcpy(p + 8, data, len);
+	put32(p + 8 + len, (uint32_t)crc32(0L, p + 4, (uInt)len + 4));
+	fileLen += 12 + len;
+}
+
+/* start a file with the signature and IHDR */
+static void start(int32_t iWidth, int32_t iHeight, int iBpp, int iType, int iInterlaced)
+{
+	static const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+	uint8_t ihdr[13];
+
+	memcpy(file, signature, 8);
+	fileLen = 8;
+	put32(ihdr, (uint32_t)iWidth);
+	put32(ihdr + 4, (uint32_t)iHeight);
+	ihdr[8] = (uint8_t)iBpp;
+	ihdr[9] = (uint8_t)iType;
+	ihdr[10] = ihdr[11] = 0;
+	ihdr[12] = (uint8_t)iInterlaced;
+	chunk("IHDR", ihdr, 13);
+	rawLen = 0;
+}
+
+/* the filtered lines in raw[] as a zlib stream of stored blocks in one
+ * IDAT, then IEND */
+static void finish(void)
+{
+	uint8_t z[MAX_FILE];
+	int32_t n = 2, i, len;
+
+	z[0] = 0x78;
+	z[1] = 0x01;
+	i = 0;
+	do {
+		len = rawLen - i > 65535 ? 65535 : rawLen - i;
+		z[n] = (uint8_t)(i + len == rawLen); /* BFINAL, stored */
+		z[n + 1] = (uint8_t)len;
+		z[n + 2] = (uint8_t)(len >> 8);
+		z[n + 3] = (uint8_t)~len;
+		z[n + 4] = (uint8_t)(~len >> 8);
+		memcpy(&z[n + 5], &raw[i], len);
+		n += 5 + len;
+		i += len;
+	} while (i < rawLen);
+	put32(&z[n], (uint32_t)adler32(1L, raw, (uInt)rawLen));
+	chunk("IDAT", z, n + 4);
+	chunk("IEND", NULL, 0);
+}
+
+/* the lines drawn go into image[] */
+static void draw(PNGDRAW *pDraw)
+{
+	int i, y;
+
+	for (i = 0; i < pDraw->iRows; i++) {
+		y = pDraw->y + i;
+		if ((long)(y + 1) * pDraw->iPitch <= MAX_FILE)
+			memcpy(&image[y * pDraw->iPitch], pDraw->pPixels + i * pDraw->iStride, pDraw->iPitch);
+	}
+}
+
+/* open the file in memory with the buffers a decode needs (an interlaced
+ * one goes into deinterlace[], whatever size it asks for) */
+static int setup(void)
+{
+	int rc;
+
+	memset(&png, 0, sizeof(png));
+	rc = PNG_openRAM(&png, file, fileLen);
+	if (rc != PNG_SUCCESS)
+		return rc;
+	png.uLine1 = line1;
+	png.uLine2 = line2;
+	png.pfnDraw = draw;
+	png.pDeinterlace = deinterlace;
+	memset(image, 0, sizeof(image));
+	return PNG_SUCCESS;
+}
+
+static int decode(int iOptions)
+{
+	int rc = setup();
+
+	if (rc != PNG_SUCCESS)
+		return rc;
+	return PNG_decode(&png, 0, iOptions);
+}
+
+/* the background PNG_probe() and both decode paths find for an 8-bit
+ * image of the type with a bKGD chunk of len bytes */
+static void checkBackground(int iType, const uint8_t *pBkgd, int32_t len, int32_t want)
+{
+	static const uint8_t plte[6] = { 1, 2, 3, 4, 5, 6 };
+	const int iOptions[2] = { 0, PNG_USE_INFBACK };
+	char what[64];
+	int i;
+
+	start(2, 2, 8, iType, 0);
+	if (iType == PNG_PIXEL_INDEXED)
+		chunk("PLTE", plte, 6);
+	chunk("bKGD", pBkgd, len);
+	rawLen = 2 * (1 + 2 * (iType == PNG_PIXEL_TRUECOLOR ? 3 : 1));
+	memset(raw, 0, rawLen);
+	finish();
+
+	memset(&png, 0, sizeof(png));
+	expect("PNG_openRAM", PNG_openRAM(&png, file, fileLen), PNG_SUCCESS);
+	expect("PNG_probe", PNG_probe(&png), PNG_SUCCESS);
+	sprintf(what, "type %d, %ld byte bKGD, probed", iType, (long)len);
+	expect(what, (int32_t)png.iBackground, want);
+	for (i = 0; i < 2; i++) {
+		expect("PNG_decode", decode(iOptions[i]), PNG_SUCCESS);
+		sprintf(what, "type %d, %ld byte bKGD, options %d", iType, (long)len, iOptions[i]);
+		expect(what, (int32_t)png.iBackground, want);
+	}
+}
+
+/* the deinterlace buffer size for a header, with and without
+ * PNG_PROGRESSIVE, 0 if it doesn't fit in an int32_t; and the decoder
+ * turning down the ones that don't */
+static void checkDeinterlaceSize(int32_t iWidth, int32_t iHeight, int32_t want, int32_t wantProgressive)
+{
+	char what[64];
+
+	start(iWidth, iHeight, 8, PNG_PIXEL_TRUECOLOR, 1);
+	finish();
+	memset(&png, 0, sizeof(png));
+	expect("PNG_openRAM", PNG_openRAM(&png, file, fileLen), PNG_SUCCESS);
+	sprintf(what, "%ldx%ld deinterlace size", (long)iWidth, (long)iHeight);
+	expect(what, PNG_getDeinterlaceSize(&png, 0), want);
+	sprintf(what, "%ldx%ld progressive deinterlace size", (long)iWidth, (long)iHeight);
+	expect(what, PNG_getDeinterlaceSize(&png, PNG_PROGRESSIVE), wantProgressive);
+	if (want == 0) {
+		sprintf(what, "%ldx%ld decode", (long)iWidth, (long)iHeight);
+		expect(what, decode(0), PNG_TOO_BIG);
+	}
+	if (wantProgressive == 0) {
+		sprintf(what, "%ldx%ld progressive decode", (long)iWidth, (long)iHeight);
+		expect(what, decode(PNG_PROGRESSIVE), PNG_TOO_BIG);
+	}
+}
+
+/* an image whose zlib stream ends two lines short, decoded from memory
+ * and fed in pieces of each size up to 7 bytes */
+static void checkShortStream(void)
+{
+	char what[64];
+	int32_t i, n;
+	int rc;
+
+	start(4, 4, 8, PNG_PIXEL_GRAYSCALE, 0);
+	rawLen = 2 * 5;
+	memset(raw, 0, rawLen);
+	finish();
+	expect("short stream decode", decode(0), PNG_DECODE_ERROR);
+	for (n = 1; n <= 7; n++) {
+		memset(&png, 0, sizeof(png));
+		png.uLine1 = line1;
+		png.uLine2 = line2;
+		png.pfnDraw = draw;
+		expect("PNG_beginFeed", PNG_beginFeed(&png, 0, 0), PNG_SUCCESS);
+		rc = PNG_NEED_MORE;
+		for (i = 0; i < fileLen && rc == PNG_NEED_MORE; i += n)
+			rc = PNG_decodeFeed(&png, &file[i], fileLen - i < n ? fileLen - i : n);
+		sprintf(what, "short stream fed %ld bytes at a time", (long)n);
+		expect(what, rc, PNG_DECODE_ERROR);
+	}
+}
+
+/* a 4x4 gray image whose third line has filter byte 7: the decode stops
+ * there with the first two lines drawn, however the lines get to it */
+static void checkBadFilter(void)
+{
+	static const char *name[7] = { "line by line", "inflateBack", "2 line strip",
+		"whole image strip", "2 lines drawn at a time", "threads", "threads, 2 lines at a time" };
+	char what[64];
+	int32_t y, x;
+	int i, iOptions;
+
+	start(4, 4, 8, PNG_PIXEL_GRAYSCALE, 0);
+	rawLen = 4 * 5;
+	for (y = 0; y < 4; y++) {
+		raw[y * 5] = (uint8_t)(y == 2 ? 7 : PNG_FILTER_NONE);
+		for (x = 0; x < 4; x++)
+			raw[y * 5 + 1 + x] = (uint8_t)(y * 4 + x + 1);
+	}
+	finish();
+	for (i = 0; i < 7; i++) {
+		expect("setup", setup(), PNG_SUCCESS);
+		iOptions = (i == 1) ? PNG_USE_INFBACK : 0;
+		if (i == 2 || i == 3) {
+			png.pStrip = strip;
+			png.iStripRows = (i == 2) ? 2 : 4;
+		}
+		if (i == 4 || i == 6) {
+			png.pDrawRows = rows;
+			png.iDrawRows = 2;
+		}
+#ifdef PNG_HAVE_THREADS
+		if (i >= 5) {
+			iOptions = PNG_THREADS;
+			png.pRing = strip;
+			png.iRingRows = 4;
+		}
+#else
+		if (i >= 5)
+			break;
+#endif
+		sprintf(what, "bad filter byte, %s", name[i]);
+		expect(what, PNG_decode(&png, 0, iOptions), PNG_DECODE_ERROR);
+		for (y = 0; y < 16; y++) {
+			sprintf(what, "bad filter byte, %s, pixel %ld", name[i], (long)y);
+			expect(what, image[y], y < 8 ? y + 1 : 0);
+		}
+	}
+
+	/* and in an Adam7 pass */
+	start(3, 3, 8, PNG_PIXEL_TRUECOLOR, 1);
+	rawLen = 45;
+	memset(raw, 0, rawLen);
+	raw[15] = 7; /* pass 6 */
+	finish();
+	expect("bad filter byte, interlaced", decode(0), PNG_DECODE_ERROR);
+}
+
+/* a 3x3 interlaced RGB image, the pixels in the passes Adam7 puts them */
+static void checkInterlaced(void)
+{
+	static const uint8_t passes[] = {
+		0, 1, 2, 3,                 /* pass 1: (0,0) */
+		0, 4, 5, 6,                 /* pass 4: (2,0) */
+		0, 7, 8, 9, 10, 11, 12,     /* pass 5: (0,2) and (2,2) */
+		0, 16, 17, 18,              /* pass 6: (1,0) */
+		0, 19, 20, 21,              /* pass 6: (1,2) */
+		0, 22, 23, 24, 25, 26, 27, 28, 29, 30 /* pass 7: row 1 */
+	};
+	static const uint8_t want[27] = {
+		1, 2, 3, 16, 17, 18, 4, 5, 6,
+		22, 23, 24, 25, 26, 27, 28, 29, 30,
+		7, 8, 9, 19, 20, 21, 10, 11, 12
+	};
+
+	start(3, 3, 8, PNG_PIXEL_TRUECOLOR, 1);
+	rawLen = sizeof(passes);
+	memcpy(raw, passes, rawLen);
+	finish();
+	expect("3x3 interlaced decode", decode(0), PNG_SUCCESS);
+	expect("3x3 interlaced pixels", memcmp(image, want, sizeof(want)), 0);
+}
+
+int main(void)
+{
+	static const uint8_t bkgd[6] = { 0x80, 0x11, 0x80, 0x22, 0x80, 0x33 };
+
+	/* 8-bit samples take the low byte of each 16-bit value */
+	checkBackground(PNG_PIXEL_TRUECOLOR, bkgd, 6, 0x332211L);
+	checkBackground(PNG_PIXEL_GRAYSCALE, bkgd, 2, 0x11);
+	checkBackground(PNG_PIXEL_INDEXED, bkgd + 1, 1, 0x11);
+	/* too short for the pixel type, left alone */
+	checkBackground(PNG_PIXEL_TRUECOLOR, bkgd, 4, 0x999999L);
+	checkBackground(PNG_PIXEL_GRAYSCALE, bkgd, 1, -1);
+	checkBackground(PNG_PIXEL_INDEXED, bkgd, 0, -1);
+
+	checkShortStream();
+	checkBadFilter();
+	checkInterlaced();
+	/* (5461 * 3 + 1) * 262145 is 2^32 + 16384 */
+	checkDeinterlaceSize(5461, 524289, 0, 0);
+	checkDeinterlaceSize(5461, 262141, 131071L * 16384, 0);
+	checkDeinterlaceSize(5461, 1, 16384, 16384);
+
+	printf("decode: %ld checks, %ld bad\n", checks, bad);
+	return bad != 0;
+}
@@ -0,0 +1,120 @@
+/* defilter - check the filter loops the decoder picks (pfnDeFilter[], the
+ * SSE2/SSSE3 ones included) against the scalar DeFilter(), bit for bit,
+ * for every filter type and pixel size, in place and not.
+ * Built and run by test.sh. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+#include "../pngdec.h"
+#include "../zlib.h"
+
+#include "../png.inl"
+
+#define MAX_PITCH (1 + 8 * 1000)
+
+static PNGIMAGE png;
+static uint8_t src[MAX_PITCH], prev[MAX_PITCH], ref[MAX_PITCH], out[MAX_PITCH];
+static long lines, bad;
+
+static const char *filterName[PNG_FILTER_COUNT] = { "None", "Sub", "Up", "Avg", "Paeth" };
+
+/* a pixel type and depth for each filter pixel size */
+static const struct { int iBpp; uint8_t ucPixelType, ucBpp; } sizes[] = {
+	{ 1, PNG_PIXEL_GRAYSCALE, 8 },
+	{ 2, PNG_PIXEL_GRAY_ALPHA, 8 },
+	{ 3, PNG_PIXEL_TRUECOLOR, 8 },
+	{ 4, PNG_PIXEL_TRUECOLOR_ALPHA, 8 },
+	{ 6, PNG_PIXEL_TRUECOLOR, 16 },
+	{ 8, PNG_PIXEL_TRUECOLOR_ALPHA, 16 }
+};
+
+/* random bytes, runs of one value now and then (Paeth ties) */
+static void fill(uint8_t *p, int n)
+{
+	int i, v = rand() & 0xff;
+
+	for (i = 0; i < n; i++) {
+		if (rand() % 4)
+			v = rand() & 0xff;
+		p[i] = (uint8_t)v;
+	}
+}
+
+/* filter f of iBpp byte pixels, the line after the filter byte, against
+ * the reference in ref[], both out of place and in place */
+static void check(PNG_DEFILTER_FUNC *pfn, const char *name, int f, int iBpp, int iPitch)
+{
+	int k;
+
+	for (k = 0; k < 2; k++) {
+		memset(out, 0xcc, sizeof(out));
+		if (k) { /* in place: the filtered line is where the result goes */
+			memcpy(out, src, iPitch + 2);
+			(*pfn)(out + 1, out + 1, prev + 1, iBpp, iPitch);
+		} else {
+			(*pfn)(out + 1, src + 1, prev + 1, iBpp, iPitch);
+		}
+		lines++;
+		if (memcmp(out + 1, ref + 1, iPitch) != 0 || out[1 + iPitch] != (k ? src[1 + iPitch] : 0xcc)) {
+			if (bad++ < 10)
+				printf("%s: %s, %d byte pixels, pitch %d%s differs\n", name, filterName[f], iBpp, iPitch,
+					k ? " in place" : "");
+		}
+	}
+}
+
+int main(void)
+{
+	int s, f, w, n, iBpp, iPitch;
+
+	srand(1);
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		iBpp = sizes[s].iBpp;
+		png.ucPixelType = sizes[s].ucPixelType;
+		png.ucBpp = sizes[s].ucBpp;
+		PNGSetFilters(&png);
+		if (png.iFilterBpp != iBpp) {
+			printf("PNGSetFilters(): %d byte pixels for %d, want %d\n", png.iFilterBpp, sizes[s].ucBpp, iBpp);
+			bad++;
+		}
+		for (f = 0; f < PNG_FILTER_COUNT; f++) {
+			for (w = 1; w * iBpp < MAX_PITCH; w = (w < 80) ? w + 1 : w * 3) {
+				for (n = 0; n < 4; n++) {
+					iPitch = w * iBpp;
+					fill(src, iPitch + 2);
+					fill(prev, iPitch + 1);
+					src[0] = (uint8_t)f;
+					DeFilter(ref, src, prev, w, iPitch);
+					check(png.pfnDeFilter[f], "pfnDeFilter[]", f, iBpp, iPitch);
+#ifdef PNG_DEFILTER_SIMD
+					/* and each SIMD loop by itself, whichever one the CPU got */
+					if (iBpp >= 3 || f == PNG_FILTER_UP) {
+						switch (f) {
+							case PNG_FILTER_SUB:
+								check(PNGSubSSE2, "PNGSubSSE2", f, iBpp, iPitch);
+								break;
+							case PNG_FILTER_UP:
+								check(PNGUpSSE2, "PNGUpSSE2", f, iBpp, iPitch);
+								break;
+							case PNG_FILTER_AVG:
+								check(PNGAvgSSE2, "PNGAvgSSE2", f, iBpp, iPitch);
+								break;
+							case PNG_FILTER_PAETH:
+								check(PNGPaethSSE2, "PNGPaethSSE2", f, iBpp, iPitch);
+								if (__builtin_cpu_supports("ssse3"))
+									check(PNGPaethSSSE3, "PNGPaethSSSE3", f, iBpp, iPitch);
+								break;
+						}
+					}
+#endif
+				}
+			}
+		}
+	}
+	printf("defilter: %ld lines, %ld bad\n", lines, bad);
+	return bad ? 1 : 0;
+}
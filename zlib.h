@@ -919,6 +919,36 @@ ZEXTERN int ZEXPORT inflateGetDictionary OF((z_streamp strm,
    stream state is inconsistent.
 */
 
+ZEXTERN int ZEXPORT inflateOutputWindow OF((z_streamp strm,
+                                            Bytef *base));
+/*
+     Tells inflate() that all of the output from base on (base being the
+   first next_out given to inflate()) stays in place and unmodified until the
+   end of the stream, so it can be used as the history for matches instead of
+   the sliding window.  No copy of the output is then made into the window.
+   The application must supply the output contiguously, continuing each
+   inflate() call where the previous one left off.  This is meant for
+   decompressing into a buffer that holds the whole output.
+
+     inflateOutputWindow must be called before any output has been produced.
+   It returns Z_OK on success, or Z_STREAM_ERROR if the stream state is
+   inconsistent, base is Z_NULL or output has already been produced.
+*/
+
+ZEXTERN int ZEXPORT inflateOutputSlack OF((z_streamp strm,
+                                           unsigned slack));
+/*
+     Tells inflate() that slack bytes past next_out + avail_out may be written
+   to as scratch space on every call, which lets match copies be done a whole
+   word at a time and run over their end.  Those bytes, and any bytes past
+   next_out on return, hold garbage.  Wide copies are only
+   made when slack is at least 16 and the library was built with
+   INFLATE_CHUNKCOPY, otherwise this has no effect.
+
+     inflateOutputSlack returns Z_OK on success, or Z_STREAM_ERROR if the
+   stream state is inconsistent.
+*/
+
 ZEXTERN int ZEXPORT inflateSync OF((z_streamp strm));
 /*
      Skips invalid compressed data until a possible full flush point (see above